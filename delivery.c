@@ -26,13 +26,203 @@
  *
  *    if no command is provided:
  *       delivery -c
- *    then "cat" is assumed and the stream is delivered on standard output
+ *    then the stream is delivered on standard output (as if by "cat", but
+ *    by delivery itself, with splice(), so without a "cat" process or its
+ *    copies); with "-o <file>", the stream is written to <file> instead
+ *
+ * delivery -u <upstream> -- is relay mode:
+ *    as server mode, but the data source is another delivery server rather
+ *    than a command; <upstream> is HOST:PORT (a server started with "-l"), a
+ *    path to a Unix domain socket, or the BASENAME of a local server; if the
+ *    upstream server goes away, the relay reconnects (with backoff) and its
+ *    clients remain connected; relays can be chained to build fan-out trees
+ *    spanning several machines
+ *
+ *    with "-c", "-u" selects the server to which the client connects
+ *
+ * delivery -i <source> -- a native source:
+ *    the server reads the stream from <source> itself, instead of running a
+ *    command: "-" (standard input), a device, a FIFO, a regular file
+ *    (mapped, the chunks point into it), a Unix domain socket, or
+ *    <host>:<port> (TCP)
+ *
+ * delivery -P <playlist> [-C] -- a sequence of sources:
+ *    the server plays the sources listed in <playlist> (one per line: a
+ *    regular file, or a command) one after the other, without a gap: the
+ *    next is opened (or started) as soon as the current one starts, and
+ *    read from as soon as the current one ends; with "-C", the list loops
+ *    (and is read again each time round); "-r" skips to the next source
+ *
+ * delivery -R <bits/s>[k|M]|mp3|ts -- real-time pacing:
+ *    for a source faster than real time (a file, or a transcoder), the
+ *    server releases the stream at the content's own pace: a constant
+ *    bitrate, the durations of MPEG audio frames, or an MPEG transport
+ *    stream's PCR
+ *
+ * delivery -k <secs> -p -- keep the source warm:
+ *    with "-k", the server keeps its source running for <secs> seconds
+ *    after the last client leaves (or for ever, if <secs> is -1), so a client
+ *    which comes along in the meantime does not wait for the source to start
+ *    up; with "-p", the server starts its source straight away, rather than
+ *    when the first client arrives; data read while there are no clients is
+ *    discarded (but kept in the history, see "-H")
+ *
+ * delivery -B <backup_command> -- a hot standby:
+ *    the server runs <backup_command> alongside <server_command>, reading
+ *    and discarding its output; if <server_command> exits or stalls (no data
+ *    for STALLWAIT ms, or as given by "-W"), the server switches to
+ *    <backup_command>'s output, and restarts <server_command>, switching back
+ *    (as for "-r") when it produces data
+ *
+ * delivery -W <secs> -- the watchdog:
+ *    if no data comes from the source for <secs> seconds, a command is
+ *    killed and restarted (or the server fails over to the standby), and an
+ *    upstream server or a socket source is reconnected; stalls are counted
+ *    in the reports
+ *
+ * delivery -t <sig>[:<ms>],... -- how to kill the source:
+ *    when a source command is to go (on restart, failover or exit), these
+ *    signals are sent to its process group in turn, each after the wait
+ *    (default 2000 ms) after the one before, for as long as it is still
+ *    running; SIGKILL is always last; the default is "TERM:2000,KILL"; the
+ *    server carries on serving its clients meanwhile
+ *
+ * delivery -F <bytes> -- flow control (lossless):
+ *    the server stops reading from the source while any client is more than
+ *    <bytes> behind, so the slowest client sets the pace (and the source is
+ *    held back), but faster clients are not held up by it within the window;
+ *    at the end of the source, the server exits once every client has had
+ *    all of the stream
+ *
+ * delivery -D rr|least|hash[:<field>] -- distribution:
+ *    each record (line) from the source goes to just one client, rather than
+ *    to all of them: to each in turn ("rr"), to the one with the least
+ *    queued ("least"), or by a hash of the record, or of its <field>th
+ *    (whitespace separated) field ("hash"), so a pool of workers (clients)
+ *    can share the work of one producer
+ *
+ * delivery -l [<host>:]<port> -- accept TCP clients too:
+ *    in addition to the Unix domain socket in "/tmp", the server also listens
+ *    for clients (and relays) on the given TCP port
+ *
+ * delivery -m <group>:<port>[,<option>...] -- multicast the stream too:
+ *    the server also sends the stream (from the same source) as UDP datagrams
+ *    to the given (multicast) group; a single copy goes on the wire however
+ *    many players are listening; options are "rtp" (RTP packetization),
+ *    "pt=<n>" (RTP payload type, default 33, MPEG-TS), "ttl=<n>", "if=<name>"
+ *    (outgoing interface) and "size=<n>" (payload bytes per datagram, default
+ *    1316, seven MPEG-TS packets); a multicast server runs its source
+ *    permanently, whether or not there are clients
+ *
+ * delivery -z -- zerocopy sends to TCP clients:
+ *    data is sent to TCP clients with MSG_ZEROCOPY from a ring of pinned
+ *    buffers, so the kernel does not copy it; a buffer is reused only once
+ *    the kernel has reported (on each socket's error queue) that all of the
+ *    zerocopy sends from it have completed; bytes sent zerocopy and copied
+ *    are reported when clients leave, when the server exits, and on SIGUSR1;
+ *    zerocopy only pays for large sends: "-z" makes the default buffer size
+ *    64KB (see "-b")
+ *
+ * delivery -b <bytes> -- buffer size:
+ *    data is read from the source and sent to clients in units of <bytes>;
+ *    the default is the page size (or the source's block size, if larger)
+ *
+ * the single-client fast path:
+ *    while there is exactly one client (and no multicast), data moves from
+ *    the source to the client with splice(), without passing through user
+ *    space; the server switches back to the usual fan-out path as soon as a
+ *    second client connects
+ *
+ * delivery -c -a [ <client_command> [ <arg> ... ] ] -- reconnecting client:
+ *    the client stays between the socket and <client_command> (or the
+ *    built-in sink); if the connection is lost, it reconnects (with backoff)
+ *    and asks the server to resume the stream from the last byte received;
+ *    <client_command> sees one continuous stream
+ *
+ * delivery -H <bytes> -- history for resuming clients:
+ *    the server keeps (at least) the last <bytes> of the stream, so that
+ *    reconnecting clients (and relays) can resume without a gap; without a
+ *    history, a client resumes without a gap only if it had received
+ *    everything that the server had sent
+ *
+ * the protocol:
+ *    a client may send a line "DELIVERY/2 caps=<cap>,... epoch=<e>
+ *    offset=<n>" as soon as it connects (the fields are optional); <cap>s
+ *    are what the client supports, transports in order of preference: "raw"
+ *    and "framed" (and others, such as "shm", which this server does not
+ *    offer and ignores), and "resume" (honour <offset>); the server replies
+ *    with a line "DELIVERY/2 mode=<mode> epoch=<e> offset=<n> caps=<caps>"
+ *    giving the transport chosen, and the stream offset at which the data
+ *    which follows starts; <epoch> identifies the server's stream, offsets
+ *    in one stream mean nothing in another ("DELIVERY/1" hellos, without
+ *    caps, are raw and resume)
+ *
+ *    in "framed" mode, each chunk of data is preceded by a FRAMEHDR byte
+ *    header (big endian): the length (4 bytes), the type (4 bytes, 'D' for
+ *    data), the stream offset (sequence number) of the chunk's first byte (8
+ *    bytes), and the time at which it was read from the source (8 bytes,
+ *    nanoseconds, CLOCK_REALTIME), from which clients measure end-to-end
+ *    latency; relays read their upstream framed, so capture times are those
+ *    of the first server in the chain
+ *
+ *    clients which say nothing for HELLOWAIT ms (such as "delivery -c cat"
+ *    run by older versions, or anything else which reads the socket)
+ *    receive the raw stream from the current point, as before
+ *
+ * delivery -c -v -- report latency:
+ *    the client reads the stream framed and reports end-to-end latency
+ *    (capture to delivery) every REPORTINT seconds and on exit
+ *
+ * delivery -c -s <ms> -- synchronised playout:
+ *    the client reads the stream framed into a playout buffer, and writes
+ *    each chunk to the consumer <ms> milliseconds after its capture time; so
+ *    clients on different machines (with synchronised clocks) play in step
+ *
+ * delivery -c -j <low>:<high>[:<max>] -- jitter buffer:
+ *    the client buffers <high> bytes before writing to the consumer; after
+ *    an underrun (the buffer and the consumer's pipe both empty), it reports
+ *    it and waits until <low> bytes are buffered; it reads at most <max>
+ *    bytes ahead (default 2 * <high>)
+ *
+ * delivery -c -e prefix:<text>|fixed:<text>|regex:<re> -- a filter:
+ *    the server sends the client only the records (lines) which start with
+ *    <text>, contain <text>, or match the (extended) regular expression
+ *    <re>, instead of the whole stream (so there's no "grep" for each
+ *    consumer); each filter is evaluated once per chunk, whichever clients
+ *    share it; the stream is raw (not with -a, -s, -j or -v)
+ *
+ * delivery -X <name>=<command> -- derived pipelines:
+ *    the server also runs a delivery server "<basename>.<name>" (one for each
+ *    "-X"), whose source is a client of this server, through <command>; a
+ *    client with "-X <name>" connects to it, rather than to this server; so
+ *    many clients share one instance of a transform (a transcoder, say),
+ *    which is started when the first of them arrives, and stopped when the
+ *    last leaves (as any source is); the derived server has "-X <name>"
+ *    too, so it stays, when it has no clients; and so does this server,
+ *    while it has derived pipelines (only their sources come and go)
+ *
+ * delivery -c -Z zstd|lz4 -- compression:
+ *    the client asks for the stream compressed on the wire; the server
+ *    compresses each chunk once (in a thread of its own), for all of the
+ *    clients which asked for the same, and the client decompresses it; a
+ *    server which cannot (or a framed or filtered client) sends the stream
+ *    as it is; built with WITH_ZSTD and/or WITH_LZ4 (see the Makefile)
+ *
+ * delivery -O PREFIX[,size=BYTES][,time=SECS] <server_command> -- recording:
+ *    the server writes the whole stream to disk itself, in segments
+ *    (PREFIX-YYYYmmdd-HHMMSS), a new one every BYTES bytes and/or SECS
+ *    seconds; the writing is done by a thread of its own, in large
+ *    (aligned) blocks, so a slow disk holds up no client; the server runs
+ *    (and records) whether or not there are clients, until its source ends
  *
  * delivery -r -- restarts <server_command>:
- *    if the server is running <server_command>, close that process and start a
- *    new instance of <server_command>; other than a possible short delay,
- *    active clients remain active, but now see data streamed from the new
- *    invocation of <server_command>
+ *    if the server is running <server_command>, start a new instance of
+ *    <server_command> and, as soon as it produces data, close the old one
+ *    (make before break); active clients remain active, but now see data
+ *    streamed from the new invocation of <server_command>, without a gap
+ *
+ *    with "-A ts" or "-A mp3", the switch is made at a frame boundary (MPEG
+ *    transport stream packets, or MPEG audio frames)
  *
  * note:
  *    delivery guarantees no particular alignment with respect to the data
@@ -75,6 +265,11 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/file.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <net/if.h>
+#include <netdb.h>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -86,10 +281,31 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <poll.h>
+#include <spawn.h>
 
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <time.h>
 #include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <regex.h>
+#include <pthread.h>
+
+#if defined(WITH_ZSTD) || defined(WITH_LZ4)
+#define WITH_COMPRESS
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4frame.h>
+#endif
 
 /* ************************************************************************
  * constants
@@ -101,6 +317,56 @@
 #define TMPDIR       "/tmp"
 #define MAXCLIENT     1024
 #define MAXNAME       64
+#define MAXBACKOFF    5000   // upstream reconnection backoff limit (ms)
+#define MAXSEGMENT    64     // datagrams per multicast batch (GSO limit)
+#define RTPHDR        12     // RTP header size
+#define ZCQUEUE       256    // outstanding zerocopy sends per client
+#define ZCRING        (8 << 20) // zerocopy ring size (bytes)
+#define ZCWAIT        1000   // wait for zerocopy completions (ms)
+#define HELLOWAIT     200    // wait for a client's hello line (ms)
+#define MAXLINE       256    // hello line length limit
+#define PROTOCOL      "DELIVERY/2"
+#define PROTOCOL1     "DELIVERY/1"
+#define FRAMEHDR      24     // framed mode: header size
+#define SRCPIPE       (1<<20) // the source's pipe size
+#define ALIGN_TS      1      // -A ts: MPEG transport stream packets ...
+#define ALIGN_MP3     2      // -A mp3: ... or MPEG audio frames
+#define TSPACKET      188
+#define STALLWAIT     2000   // ms: a source silent for this long has stalled
+#define RETRYWAIT     5000   // ms: before restarting a failed standby or primary
+#define PACE_RATE     1      // -R: pace at a constant bitrate ...
+#define PACE_MP3      2      // ... at MPEG audio frames' durations ...
+#define PACE_TS       3      // ... or at an MPEG transport stream's PCR
+#define PACEAHEAD     250    // ms: data is released this far ahead of time
+#define PACESLACK     1000   // ms: the clock is reset if this far behind
+#define DIST_RR       1      // -D rr: each record to the next client in turn ...
+#define DIST_LEAST    2      // ... least: to the client with the least queued ...
+#define DIST_HASH     3      // ... hash: by (a field of) the record
+#define DISTIOV       64     // records queued per client, per writev()
+#define DISTMAX       (32<<20) // records kept while there are no clients (bytes)
+#define MAXIOV        1024   // (IOV_MAX, on Linux)
+#define MAXFILTER     64     // -e: distinct filters
+#define MAXRECORD     (1<<20) // -e: longer records are not filtered (they're dropped)
+#define FILT_PREFIX   1      // -e prefix:<text> ...
+#define FILT_FIXED    2      // ... fixed:<text> ...
+#define FILT_REGEX    3      // ... regex:<re>
+#define MAXDERIVED    16     // -X: derived pipelines
+#define DERIVEDUP     5000   // -X: a derived server which lasts this long (ms) is restarted
+#define DERIVEDDRAIN  1000   // -X: ms for derived servers to finish, at the end of the stream
+#define COMP_ZSTD     1      // -Z zstd ...
+#define COMP_LZ4      2      // ... lz4
+#define COMPQUEUE     256    // -Z: chunks waiting for the compression thread
+#define COMPDRAIN     1000   // -Z: ms for the compression thread to finish, at the end of the stream
+#define COMPSENDWAIT  1000   // -Z: ms for a compressed client to take a chunk, before it is dropped
+#define RECBLOCK      (1 << 20) // -O: the recorder's writes (bytes)
+#define RECQUEUE      64     // -O: blocks waiting to be written (the source is held back, beyond this)
+#define RECFLUSH      1000   // -O: ms before a partial block is written
+#define RECPREALLOC   (256LL << 20) // -O: space reserved for a segment, without size=
+#define KILLSTEPS     8      // -t: signals in the kill strategy
+#define KILLTICK      100    // ms: checks on sources being killed
+#define MAXDYING      16     // sources being killed at once
+#define REPORTINT     10     // client: latency report interval (s)
+#define PLAYOUTMAX    (32<<20) // client: playout buffer limit (bytes)
 
 /* ************************************************************************
  * static data
@@ -109,18 +375,136 @@
  * initialise these ...
  */
 
-static FILE *src;            // data source (popen)
+static int   src = -1;       // data source (a pipe from the command, or upstream socket)
+static pid_t src_pid;        // the source command
+static long long src_start;  // the stream offset at which the source started
+static int   next_src = -1;  // restart: the new source, not yet producing data ...
+static pid_t next_pid;       // ... and its command
+static int   align;          // align restarts to frames (-A): ALIGN_TS or ALIGN_MP3
+static char *backup;         // the standby command (-B)
+static int   sb_src = -1;    // the standby, running, its output discarded ...
+static pid_t sb_pid;         // ... and its command
+static int   on_backup;      // the source is the backup command (after failover)
+static int   stall_ms = STALLWAIT; // a source silent this long has stalled
+static int   stalled;        // ... as it has
+static long long sb_retry;   // when to (re)start the standby, or the primary
+static int   watchdog;       // seconds without data before the source is restarted (-W)
+static int   wd_fired;       // ... as it has been
+static int   pace;           // real-time pacing (-R): PACE_RATE, PACE_MP3 or PACE_TS ...
+static long long pace_bps;   // ... the bitrate (PACE_RATE)
+static long long pace_t0, pace_pos; // the content's clock: when it started, and where it is (ns)
+static int   pace_fd = -1;   // timerfd: waiting for the content's clock
+static char *playlist;       // a file listing the sources (-P) ...
+static int   pl_loop;        // ... to be looped (-C)
+static char **pl_items;      // the sources listed ...
+static int   pl_count, pl_idx; // ... how many, and the one playing
+static int   pl_next = -1;   // the next, opened ahead (so there is no gap) ...
+static pid_t pl_next_pid;    // ... and its command (or 0, a file) ...
+static int   pl_next_idx;    // ... and its place in the list
 static int   src_fd;         // Unix domain socket
-static int   src_kill;       // whether and how to kill src on SIGTERM
-static int   fd[MAXCLIENT];  // client file descriptors
+static int   tcp_fd;         // TCP socket (-l)
+static int   kill_sig[KILLSTEPS] = { SIGTERM, SIGKILL }; // how to kill a source (-t) ...
+static int   kill_ms[KILLSTEPS]  = { 2000 };  // ... waiting this long after each signal
+static int   kill_steps = 2;
+static timer_t kill_timer;   // KILLTICK, while sources are being killed
+static struct dying { pid_t pid; int step; long long due; } dying[MAXDYING];
+static int   ndying;
+static int   sig_fd = -1;    // signalfd: the server's signals
+static int   exiting;        // in die(): only SIGCHLD and the timers now
 static int   cnt;            // client count
-static int   reopen;         // should the server re-popen <server_command>?
+static int   reopen;         // should the server restart <server_command>?
 static char *buffer;	     // buffer: <server_command> -> buffer -> <client_command>
 static int   bufsz;	     // buffer size
 static int   err;            // generic integer error variable
 static int   i;              // generic integer variable
 static char  *cp;            // generic string variable
 static int   world;          // world writable socket
+static char *upstream;       // upstream delivery server (-u)
+static char *listen_on;      // TCP address on which to listen (-l)
+static char *mcast;          // multicast group and options (-m)
+static char *input;          // native source (-i)
+static char *src_map;        // a regular file source, mapped ...
+static loff_t src_size, src_pos; // ... its size, and the position in it
+static int   mcast_fd;       // multicast (UDP) socket
+static int   pidfile_ours;   // did this process write the PID file?
+
+static int   zerocopy;       // MSG_ZEROCOPY sends to TCP clients (-z)
+static int   history;        // bytes of history to keep (-H)
+static int   window;         // flow control (-F): the slowest client is at most this far behind
+static int   dist;           // distribution (-D): DIST_RR, DIST_LEAST or DIST_HASH ...
+static int   dist_field;     // ... the field hashed (1 is the first), or 0 (the line)
+static char *filter;         // client: only the records matching this (-e)
+static char *derived;        // client: the derived pipeline (-X)
+static char *record;         // recording (-O): PREFIX[,size=BYTES][,time=SECS]
+static int   codec;          // client: compression asked for (-Z), COMP_ZSTD or COMP_LZ4 ...
+static int   unpacking;      // ... and granted
+static char *dv_name[MAXDERIVED], *dv_cmd[MAXDERIVED]; // the derived pipelines (-X) ...
+static pid_t dv_pid[MAXDERIVED];   // ... their servers ...
+static long long dv_start[MAXDERIVED]; // ... and when they were started
+static int   nderived;
+static int   linger;         // seconds to keep the source after the last client (-k), -1: for ever
+static int   prestart;       // start the source before the first client (-p)
+static int   served;         // has there been a client?
+static long long idle_since; // when the last client left (ms)
+
+static unsigned long long epoch;   // identifies this server's stream
+static long long offset;     // stream offset: bytes read from the source
+static unsigned long long up_epoch;// relay: the upstream server's stream ...
+static long long up_offset;  // ... and our offset in it
+static int   up_left;        // relay: bytes left in the current upstream frame
+static long long up_ts;      // relay: and its capture time
+
+/* the ring: the most recent nchunk buffers read from the source, buffer is
+ * ring[head].data; a chunk is not reused until all of the zerocopy sends
+ * from it have completed; a chunk with len 0 holds no data
+ */
+
+struct chunk
+{
+   char     *data;
+   int       len;
+   long long off;            // stream offset of data[0]
+   long long ts;             // capture time (ns, CLOCK_REALTIME)
+   int       zc;             // outstanding zerocopy sends from this chunk
+};
+
+static struct chunk *ring;
+static char *ring_mem;       // the chunks' own buffers
+static int   nchunk;
+static int   head;
+
+/* clients: with zerocopy, each send is numbered (by the kernel, per socket)
+ * and zc_chunk[] maps those numbers (modulo ZCQUEUE) to the chunk sent, or
+ * -1 once the send is complete
+ */
+
+struct client
+{
+   int       fd;
+   long long off;                // stream offset of the next byte to send
+   long long hello;              // waiting for a hello until (ms), or 0
+   char      line[MAXLINE];      // the hello line, so far
+   int       nline;
+   int       framed;             // framed mode?
+   unsigned char hdr[FRAMEHDR];  // framed: the current frame's header ...
+   int       hdr_left;           // ... the bytes of it still to send ...
+   int       frame_left;         // ... and of its payload
+   int       zc;                 // MSG_ZEROCOPY enabled on this socket?
+   unsigned  zc_next;            // the number of the next zerocopy send
+   short     zc_chunk[ZCQUEUE];
+   int       zc_len[ZCQUEUE];
+   long long zc_bytes;           // bytes sent zerocopy
+   long long zc_copied;          // bytes sent with MSG_ZEROCOPY, but copied
+   long long cp_bytes;           // bytes sent with write()
+   int       filter;             // -e: its filter (filters[filter - 1]), or 0
+   int       codec;              // -Z: compressed (so handed over to the compression thread), or 0
+};
+
+static struct client clients[MAXCLIENT];
+
+static long long zc_bytes, zc_copied, cp_bytes; // totals for departed clients
+static int   failovers;      // to the standby
+static int   stalls;         // sources restarted by the watchdog
 
 static char *tmpbasename;
 static char *PIDFILE;
@@ -132,6 +516,27 @@ static char *LOCKFILE;
  */
 
 void close_src();
+void stop_src(pid_t pid);
+void stop_wait();
+void derived_gone(pid_t pid);
+void derived_stop(int drain);
+void signals();
+void reopen_src(int s);
+void report();
+long long now_ms();
+void drop_client(int i);
+int  filter_add(char *spec);
+void filter_drop(int f);
+int  comp_codec(char *name);
+int  comp_users();
+void comp_add(struct client *c);
+void comp_stop(int drain);
+void comp_report();
+void rec_stop();
+void rec_report();
+void alloc_ring();
+void zc_wait(int k);
+char *print(char *prev, const char *format, ...);
 
 /* ************************************************************************
  * die cleanly (although it probably matters little)
@@ -142,22 +547,312 @@ void rm_pidfile();
 
 void die(char *message, int e)
 {
-   rm_sockfile();
+   if ( src_fd ) // only the server's own (not when "-r" or a client dies)
+      rm_sockfile();
    rm_pidfile();
 
    if ( message )
       fprintf(stderr, "exit %d: %s\n", e, message);
 
    close_src();
+   comp_stop(e == 0);
+   rec_stop();
+   derived_stop(e == 0);
+   stop_wait();
+   if ( tcp_fd )
+      close(tcp_fd);
+   if ( mcast_fd )
+      close(mcast_fd);
+   if ( src_fd || pidfile_ours ) // (a server's, not a client's or "-r"'s)
+      report();
    while ( cnt )
-      close(fd[--cnt]);
+      close(clients[--cnt].fd);
 
    exit(e);
 }
 
-void sig_die(int signal)
+/* the watchdog (-W): a timer, every quarter of the interval, checks that the
+ * stream offset has moved on (so nothing is added to the main loop); if it
+ * has not, and there is nothing waiting to be read (so the server itself is
+ * not the hold up), then the source has stalled: the wait for it gives up
+ * (see wait_for()), and src_lost() restarts it (or fails over to the
+ * standby)
+ */
+
+void watchdog_tick()
+{
+   static long long last = -1, since;
+   long long now = now_ms();
+   int n = 0;
+
+   if ( src == -1 || offset != last || wd_fired || ( ioctl(src, FIONREAD, &n) == 0 && n > 0 ) )
+   {
+      last  = offset;
+      since = now;
+      return;
+   }
+
+   if ( now - since < watchdog * 1000LL )
+      return;
+
+   wd_fired = 1;
+   stalls  += 1;
+   since    = now; // (the restarted source has the whole interval)
+}
+
+/* killing a source (-t): the first of the strategy's signals is sent to its
+ * process group, then, each time the wait after a signal passes and the
+ * group is still there, the next (the last is always SIGKILL); all on the
+ * kill timer's ticks, so the server carries on serving its clients
+ * meanwhile, and the children are reaped by reap() as they exit
+ */
+
+void kill_tick()
+{
+   long long now = now_ms();
+   int k;
+
+   for (k = 0; k < ndying; )
+   {
+      struct dying *d = &dying[k];
+      int r = waitpid(d->pid, NULL, WNOHANG);
+      int reaped = r == d->pid || ( r == -1 && errno == ECHILD );
+
+      /* done when the group has gone, or (as its members may be zombies,
+       * reparented, for a while) when SIGKILL has been sent to it and the
+       * command itself has been reaped
+       */
+      if ( ( kill(-d->pid, 0) == -1 && errno == ESRCH ) || ( reaped && d->step + 1 == kill_steps ) )
+      {
+	 *d = dying[--ndying];
+	 continue;
+      }
+      if ( now >= d->due && d->step + 1 < kill_steps )
+      {
+	 d->step += 1;
+	 d->due   = now + kill_ms[d->step];
+	 fprintf(stderr, "source %d: still running, signal %d\n", (int) d->pid, kill_sig[d->step]);
+	 kill(-d->pid, kill_sig[d->step]);
+      }
+      k += 1;
+   }
+
+   if ( ! ndying )
+      timer_settime(kill_timer, 0, &(struct itimerspec) { { 0, 0 }, { 0, 0 } }, NULL);
+}
+
+/* stop a source (a command): start killing it, as above
+ */
+
+void stop_src(pid_t pid)
+{
+   struct itimerspec tick = { { 0, KILLTICK * 1000000L }, { 0, KILLTICK * 1000000L } };
+
+   if ( pid <= 0 ) // (a file, from the playlist)
+      return;
+
+   kill(-pid, kill_sig[0]);
+   if ( ndying < MAXDYING )
+   {
+      dying[ndying++] = (struct dying) { pid, 0, now_ms() + kill_ms[0] };
+      timer_settime(kill_timer, 0, &tick, NULL);
+   }
+   else
+      kill(-pid, SIGKILL);
+}
+
+/* wait for the sources being killed to go (at exit): no longer than the
+ * strategy's waits, in all
+ */
+
+void stop_wait()
+{
+   struct pollfd pfd = { sig_fd, POLLIN, 0 };
+
+   exiting = 1;
+   while ( ndying )
+      if ( poll(&pfd, 1, -1) == -1 && errno != EINTR )
+	 break;
+      else
+	 signals();
+}
+
+/* parse a kill strategy (-t): SIG[:MS],... -- signals, by name or number,
+ * each with the time to wait (ms) before the next; SIGKILL is added if it
+ * is not the last
+ */
+
+void kill_strategy(char *spec)
+{
+   static struct { char *name; int sig; } names[] = {
+      { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "TERM", SIGTERM },
+      { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE },
+      { 0, 0 } };
+   char *s = strdup(spec), *tok, *save, *ms;
+   int k;
+
+   kill_steps = 0;
+   for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(0, ",", &save))
+   {
+      if ( kill_steps == KILLSTEPS - 1 )
+	 die("-t: too many signals", EINVAL);
+      if ( (ms = strchr(tok, ':')) )
+	 *ms++ = 0;
+      if ( ! strncasecmp(tok, "SIG", 3) )
+	 tok += 3;
+      for (k = 0; names[k].name && strcasecmp(names[k].name, tok); k += 1)
+	 ;
+      if ( ! (kill_sig[kill_steps] = names[k].name ? names[k].sig : atoi(tok)) || kill_sig[kill_steps] >= NSIG )
+	 die("-t: signal", EINVAL);
+      kill_ms[kill_steps++] = ms ? atoi(ms) : 2000;
+   }
+
+   if ( ! kill_steps || kill_sig[kill_steps - 1] != SIGKILL )
+      kill_sig[kill_steps++] = SIGKILL;
+   free(s);
+}
+
+/* children: reap them; the current source's end is seen as end of file on
+ * its pipe, after whatever it wrote last has been read
+ */
+
+void reap()
+{
+   int status;
+   pid_t pid;
+
+   while ( (pid = waitpid(-1, &status, WNOHANG)) > 0 )
+      if ( pid != src_pid )
+      {
+	 fprintf(stderr, "source %d exited (%d)\n", (int) pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+	 derived_gone(pid);
+      }
+}
+
+/* the server's signals are blocked, and read from a signalfd wherever the
+ * server waits (so nothing it does is interrupted, and each is handled in
+ * its turn): SIGHUP restarts the source, SIGTERM and SIGINT end the server,
+ * SIGCHLD reaps, SIGUSR1 reports, and SIGALRM is the timers' tick
+ */
+
+void signals()
+{
+   struct signalfd_siginfo si;
+
+   while ( read(sig_fd, &si, sizeof(si)) == sizeof(si) )
+      switch ( si.ssi_signo )
+      {
+	 case SIGHUP:
+	    if ( ! exiting )
+	       reopen_src(SIGHUP);
+	    break;
+	 case SIGTERM:
+	 case SIGINT:
+	    if ( ! exiting )
+	       die("signal, die", (int) si.ssi_signo);
+	    break;
+	 case SIGCHLD:
+	    reap();
+	    break;
+	 case SIGUSR1:
+	    report();
+	    break;
+	 case SIGALRM:
+	    if ( watchdog )
+	       watchdog_tick();
+	    if ( ndying )
+	       kill_tick();
+	    break;
+      }
+}
+
+/* wait for <fd> (a source) to be readable, handling signals meanwhile,
+ * and taking in new clients and their hellos (so that those which arrive
+ * while the source is quiet have its next chunk), and dropping those which
+ * leave (returning 0, so the caller looks again); returns -1 if the
+ * watchdog fires, or if the source is to be restarted (back in the main
+ * loop, open_src() starts the new one), or closed (there's no longer
+ * demand: the last client has gone, and any linger is over)
+ */
+
+void accept_clients(int lfd);
+void check_hellos();
+int demand();
+
+int wait_for(int fd)
+{
+   struct pollfd pfd[4 + MAXCLIENT] = { { fd, POLLIN, 0 }, { sig_fd, POLLIN, 0 } };
+   long long wait;
+   int k, n, base, gone;
+
+   while ( ! wd_fired && ! ( reopen && fd == src ) )
+   {
+      n    = 2;
+      wait = -1;
+      if ( src_fd )
+	 pfd[n++] = (struct pollfd) { src_fd, POLLIN, 0 };
+      if ( tcp_fd )
+	 pfd[n++] = (struct pollfd) { tcp_fd, POLLIN, 0 };
+      for (k = 0, base = n; k < cnt; k += 1)
+      {
+	 pfd[n++] = (struct pollfd) { clients[k].fd, clients[k].hello ? POLLIN : POLLRDHUP, 0 };
+	 if ( clients[k].hello && ( wait == -1 || clients[k].hello - now_ms() < wait ) )
+	    wait = clients[k].hello > now_ms() ? clients[k].hello - now_ms() : 0;
+      }
+      if ( fd == src && idle_since && linger > 0 && ( wait == -1 || idle_since + linger * 1000LL - now_ms() < wait ) )
+	 wait = idle_since + linger * 1000LL > now_ms() ? idle_since + linger * 1000LL - now_ms() : 0;
+
+      if ( poll(pfd, n, (int) wait) == -1 && errno != EINTR )
+	 die("poll", errno);
+      if ( pfd[1].revents )
+	 signals();
+      for (k = cnt - 1, gone = 0; k >= 0; k -= 1) // (from the end, as drop_client() moves those after)
+	 if ( ! clients[k].hello && pfd[base + k].revents )
+	 {
+	    drop_client(k);
+	    gone = 1;
+	 }
+      if ( src_fd )
+	 accept_clients(src_fd);
+      if ( tcp_fd )
+	 accept_clients(tcp_fd);
+      check_hellos();
+      if ( fd == src && ! demand() )
+	 reopen = 1; // (nobody is left, or the linger is over: back in the main loop, close_src())
+      else if ( pfd[0].revents || gone )
+	 return 0;
+   }
+
+   return -1;
+}
+
+/* ************************************************************************
+ * is the source wanted?  yes, if there are clients, or if there's a sink
+ * (such as multicast) which is not a client; also, with "-p", before the
+ * first client arrives, and, with "-k", for a while after the last one
+ * leaves (so the source is warm when the next one comes along)
+ */
+
+int demand()
 {
-   die("signal, die", signal);
+   if ( cnt || mcast_fd || record || comp_users() )
+   {
+      served     = 1;
+      idle_since = 0;
+      return 1;
+   }
+
+   if ( ! served )
+      return prestart;
+
+   if ( ! idle_since )
+   {
+      idle_since = now_ms();
+      if ( linger )
+	 fprintf(stderr, "linger: %ds\n", linger);
+   }
+
+   return linger < 0 || now_ms() - idle_since < linger * 1000LL;
 }
 
 /* ************************************************************************
@@ -188,7 +883,8 @@ void mk_nonblocking(int fd)
 
 void rm_pidfile()
 {
-   unlink(PIDFILE);
+   if ( pidfile_ours )
+      unlink(PIDFILE);
 }
 
 void wrt_pidfile()
@@ -197,6 +893,7 @@ void wrt_pidfile()
    
    if ( ! ( fp = fopen(PIDFILE, "w") ) )
       die("fopen PIDFILE", errno);
+   pidfile_ours = 1;
    atexit(rm_pidfile);
 
    fprintf(fp, "%d", getpid());
@@ -239,13 +936,13 @@ void rm_sockfile()
    unlink(SOCKFILE);
 }
 
-struct sockaddr_un mk_sockaddr()
+struct sockaddr_un mk_sockaddr(const char *path)
 {
    struct sockaddr_un addr;
 
    bzero(&addr, sizeof(addr));
 
-   strncpy(addr.sun_path, SOCKFILE, sizeof(addr.sun_path) - 1);
+   strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
    addr.sun_family = AF_UNIX;
 #if defined(__FreeBSD__)
    addr.sun_len = SUN_LEN(&addr) + 1 /* the NULL byte */ ;
@@ -254,60 +951,145 @@ struct sockaddr_un mk_sockaddr()
    return addr;
 }
 
-/* ************************************************************************
- * routine for server to check for new clients
+/* split "[HOST:]PORT" (HOST may be a bracketed IPv6 address) and resolve it;
+ * returns NULL (with a message) on failure
  */
 
-void check_for_new_clients()
+struct addrinfo *mk_addrinfo(const char *spec, int passive, int type)
 {
+   struct addrinfo hints, *res;
+   char *host = print(0, "%s", spec);
+   char *name = host;
+   char *port = strrchr(host, ':');
 
-   /* first time through ...
-    */
+   if ( port )
+      *port++ = 0;
+   else
+   {
+      port = host; // just a port
+      name = "";
+   }
 
-   if ( src_fd == 0 )
+   if ( *name == '[' && name[strlen(name) - 1] == ']' )
    {
-      struct sockaddr_un addr = mk_sockaddr();
+      name[strlen(name) - 1] = 0;
+      name += 1;
+   }
 
-      rm_sockfile();
-      atexit(rm_sockfile);
+   bzero(&hints, sizeof(hints));
+   hints.ai_family   = AF_UNSPEC;
+   hints.ai_socktype = type;
+   hints.ai_flags    = passive ? AI_PASSIVE : 0;
 
-      // mask_t mask;
-      int mask;
+   if ( (err = getaddrinfo(*name ? name : NULL, port, &hints, &res)) )
+   {
+      fprintf(stderr, "%s: %s\n", spec, gai_strerror(err));
+      res = NULL;
+   }
 
-      if ( (src_fd = socket(PF_LOCAL, SOCK_STREAM, 0)) < 0 )
-	 die("socket", errno);
+   free(host);
+   return res;
+}
 
-      if ( world )
-         mask = umask(0);
+/* connect to a delivery server; <spec> is HOST:PORT (TCP), a path to a Unix
+ * domain socket (it contains a "/"), or the BASENAME of a local server; NULL
+ * means this server's own socket; returns -1 (errno set) on failure
+ */
 
-      if( bind(src_fd, (struct sockaddr *) &addr, SUN_LEN(&addr)) != 0 )
-	 die("bind", errno);
+int connect_to(const char *spec)
+{
+   int fd = -1;
 
-      if ( world )
-         umask(mask);
+   if ( spec && ! strchr(spec, '/') && strchr(spec, ':') )
+   {
+      struct addrinfo *res, *ai;
 
-      if ( listen(src_fd, 10) != 0 )
-	 die("listen", errno);
+      if ( ! ( res = mk_addrinfo(spec, 0, SOCK_STREAM) ) )
+      {
+	 errno = EHOSTUNREACH;
+	 return -1;
+      }
+
+      for (ai = res; ai; ai = ai->ai_next)
+      {
+	 if ( (fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0 )
+	    continue;
+	 if ( connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 )
+	    break;
+	 err = errno;
+	 close(fd);
+	 errno = err;
+	 fd = -1;
+      }
+
+      freeaddrinfo(res);
+      return fd;
    }
 
-   /* every time through ...
-    */
+   char *path = ! spec             ? print(0, "%s", SOCKFILE)
+	      : strchr(spec, '/') ? print(0, "%s", spec)
+	      : print(0, "%s/delivery.%s.sock", TMPDIR, spec);
+   struct sockaddr_un addr = mk_sockaddr(path);
+   free(path);
 
-   int client_fd;
+   if ( (fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 )
+      return -1;
 
-   /* the src_fd must be blocking if there are no clients, and non-blocking
-    * otherwise; the client_fd inherits the blocking status of src_fd, so it
-    * must be explicitly made blocking after accept
-    */
+   if ( connect(fd, (struct sockaddr *) &addr, SUN_LEN(&addr)) )
+   {
+      err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+   }
+
+   return fd;
+}
+
+/* ************************************************************************
+ * routine for server to check for new clients
+ */
 
-   if ( cnt == 0 )
+void listen_tcp()
+{
+   struct addrinfo *res, *ai;
+   int on = 1;
+
+   if ( ! ( res = mk_addrinfo(listen_on, 1, SOCK_STREAM) ) )
+      die("-l", EINVAL);
+
+   for (ai = res; ai; ai = ai->ai_next)
    {
-      fprintf(stderr, "delivery server: blocking ...\n");
-      mk_blocking(src_fd);
+      if ( (tcp_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0 )
+	 continue;
+      setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      if ( bind(tcp_fd, ai->ai_addr, ai->ai_addrlen) == 0 )
+	 break;
+      close(tcp_fd);
+      tcp_fd = 0;
    }
 
+   freeaddrinfo(res);
+
+   if ( ! tcp_fd )
+      die("bind (tcp)", errno);
+
+   if ( listen(tcp_fd, 10) != 0 )
+      die("listen (tcp)", errno);
+
+   mk_nonblocking(tcp_fd);
+   fprintf(stderr, "listening: %s\n", listen_on);
+}
+
+/* accept all pending clients on listening socket <lfd>
+ */
+
+void accept_clients(int lfd)
+{
+   int client_fd;
+
 accept_client:
-   client_fd = accept(src_fd, NULL, 0);
+   client_fd = accept4(lfd, NULL, 0, SOCK_CLOEXEC);
 
    if ( client_fd == -1 && errno == EWOULDBLOCK )
       return; // normal exit point
@@ -318,11 +1100,12 @@ accept_client:
    if ( client_fd == -1 )
       die("accept",errno);
 
-   /* we reach here only if there is in fact a new client connecting
+   /* we reach here only if there is in fact a new client connecting; the
+    * client_fd may inherit the non-blocking status of lfd, so it must be
+    * explicitly made blocking (and it's close-on-exec, so that the source
+    * does not hold the connection open after the server has gone)
     */
 
-   fprintf(stderr, "delivery server: non-blocking ...\n");
-   mk_nonblocking(src_fd);
    mk_blocking(client_fd);
 
    if ( MAXCLIENT == cnt )
@@ -332,8 +1115,22 @@ accept_client:
    }
    else
    {
+      struct client *c = &clients[cnt];
+
       fprintf(stderr, "new: %d/%d --> %d\n", cnt, cnt, cnt + 1);
-      fd[cnt++] = client_fd;
+      bzero(c, sizeof(*c));
+      c->fd = client_fd;
+      c->hello = now_ms() + HELLOWAIT;
+      memset(c->zc_chunk, 0xff, sizeof(c->zc_chunk));
+
+      /* SO_ZEROCOPY fails on Unix domain sockets; they're copied
+       */
+
+      int on = 1;
+      if ( zerocopy && lfd == tcp_fd )
+	 c->zc = setsockopt(client_fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+
+      cnt += 1;
    }
 
    /* loop back, and try to accept another client ...
@@ -342,183 +1139,4170 @@ accept_client:
    goto accept_client;
 }
 
-/* ************************************************************************
- */
-
-void reopen_src(int s)
+void check_for_new_clients()
 {
-   fprintf(stderr, "signal %d (reopen_src)\n", s);
-   if ( src )
-      reopen = 1;
-}
 
-void close_src()
-{
-   if ( src )
+   /* first time through ...
+    */
+
+   if ( src_fd == 0 )
    {
-      signal(SIGCHLD, SIG_DFL);
-      pclose(src);
-      // is there a race condition here?  can we be sure that any SIGCHLD has
-      // been delivered at this point?
-      signal(SIGCHLD, sig_die);
-      src = NULL;
-   }
-   reopen = 0;
-}
+      struct sockaddr_un addr = mk_sockaddr(SOCKFILE);
 
-char *print(char *prev, const char *format, ...) {
-   char *cp = 0;
-   va_list ap;
-   va_start(ap,format);
-   if ( ! vasprintf(&cp, format, ap) )
-      perror("vasprintf failed)");
-   if ( ! cp )
-      perror("vasprintf/malloc failed)");
-   va_end(ap);
-   if ( prev )
-      free(prev);
-   return cp;
-}
+      rm_sockfile();
+      atexit(rm_sockfile);
 
-void open_src(char *argv[])
-{
-   if ( reopen || cnt == 0 ) close_src();
-   if ( src    || cnt == 0 ) return;
+      // mask_t mask;
+      int mask;
 
-   cp = 0;
-   for (i=0; argv[i]; i+=1)
-      cp = print(cp, "%s%s%s", i ? cp : "", i ? " " : "", argv[i]);
+      if ( (src_fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 )
+	 die("socket", errno);
 
-   fprintf(stderr, "popen: %s\n", cp);
-   if ( ! ( src = popen(cp, "r") ) )
-      die(argv[0], EBADF);
+      if ( world )
+         mask = umask(0);
 
-   free(cp);
-}
+      if( bind(src_fd, (struct sockaddr *) &addr, SUN_LEN(&addr)) != 0 )
+	 die("bind", errno);
 
-/* ************************************************************************
- */
+      if ( world )
+         umask(mask);
 
-int read_buf()
-{
-   assert(src);
+      if ( listen(src_fd, 10) != 0 )
+	 die("listen", errno);
 
-   if ( buffer == NULL )
-   {
-      /* choose a size for the read/write buffer and allocate space
-       *   (not sure why we're bothering with this; might as well just choose
-       *   bufsz = 4096 and be done)
-       */
-      struct stat sb;
+      mk_nonblocking(src_fd);
 
-      if ( ( bufsz = (int) sysconf(_SC_PAGESIZE) ) == -1 )
-	 die("sysconf", errno);
+      if ( listen_on )
+	 listen_tcp();
+   }
 
-      if ( fstat(fileno(src), &sb) == -1 )
-	 die("stat", errno);
+   /* every time through ...
+    *
+    * the listening sockets are non-blocking; if there are no clients, then
+    * block (in poll) until one of them has a client waiting
+    */
 
-      if ( sb.st_blksize > bufsz )
+   if ( ! demand() )
+   {
+      struct pollfd pfd[3] = { { sig_fd, POLLIN, 0 }, { src_fd, POLLIN, 0 }, { tcp_fd, POLLIN, 0 } };
+
+      if ( src != -1 ) // (a derived server, or one with derived pipelines, idle: its source is no longer wanted)
+	 close_src();
+
+      fprintf(stderr, "delivery server: blocking ...\n");
+      do
+      {
+	 if ( poll(pfd, tcp_fd ? 3 : 2, -1) == -1 && errno != EINTR )
+	    die("poll", errno);
+	 if ( pfd[0].revents )
+	    signals();
+      }
+      while ( ! pfd[1].revents && ! pfd[2].revents );
+      fprintf(stderr, "delivery server: non-blocking ...\n");
+   }
+
+   accept_clients(src_fd);
+   if ( tcp_fd )
+      accept_clients(tcp_fd);
+}
+
+/* ************************************************************************
+ * new clients' hellos
+ */
+
+long long now_ms()
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long now_ns()
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* framed mode headers
+ */
+
+void put_be(unsigned char *p, unsigned long long v, int n)
+{
+   while ( n-- )
+   {
+      p[n] = v & 0xff;
+      v >>= 8;
+   }
+}
+
+unsigned long long get_be(unsigned char *p, int n)
+{
+   unsigned long long v = 0;
+
+   while ( n-- )
+      v = ( v << 8 ) | *p++;
+   return v;
+}
+
+void mk_frame(unsigned char *h, int len, int type, long long seq, long long ts)
+{
+   put_be(h,      len,  4);
+   put_be(h + 4,  type, 4);
+   put_be(h + 8,  seq,  8);
+   put_be(h + 16, ts,   8);
+}
+
+/* the oldest stream offset still available in the ring
+ */
+
+long long oldest()
+{
+   int k, n;
+
+   if ( ! ring )
+      return offset;
+
+   for (k = ( head + 1 ) % nchunk, n = 0; n < nchunk; k = ( k + 1 ) % nchunk, n += 1)
+      if ( ring[k].len )
+	 return ring[k].off;
+
+   return offset;
+}
+
+/* admit client <c>, from stream offset <off>
+ */
+
+void admit(struct client *c, long long off)
+{
+   c->hello = 0;
+   c->off   = off;
+   if ( window ) // (see flow())
+      mk_nonblocking(c->fd);
+}
+
+/* a hello: "DELIVERY/2 caps=<cap>,... [epoch=<hex>] [offset=<n>]
+ * [filter=<spec>] [compress=<codec>]" (or "DELIVERY/1 ...", raw and
+ * resume); the mode is the first of the client's caps which this server
+ * offers (raw, with -D or a filter); with "resume", resume from <offset>,
+ * if it's in this stream and still available, otherwise from the oldest
+ * data available (there's a gap) or the current point (another stream);
+ * <spec> (%-escaped) is a filter (-e), from the current point (refused
+ * with -D or -F, or if it does not compile); <codec> (-Z) is granted for a
+ * raw, unfiltered stream, if it is built in; the reply gives
+ * the mode, epoch and offset, the caps offered, and "filter=on" and
+ * "compress=<codec>" if granted; returns -1 if this is not a hello
+ */
+
+int hello(struct client *c)
+{
+   unsigned long long e = 0;
+   long long off = -1, start;
+   char *tok, *save, *cap, *csave, *mode = 0, *spec = 0, *packed = 0, reply[MAXLINE];
+   int v1, resume;
+
+   *(char *) memchr(c->line, '\n', c->nline) = 0;
+
+   if ( ! ( tok = strtok_r(c->line, " \r", &save) ) )
+      return -1;
+
+   if ( ! ( v1 = ! strcmp(tok, PROTOCOL1) ) && strcmp(tok, PROTOCOL) )
+      return -1;
+
+   resume = v1;
+   while ( (tok = strtok_r(NULL, " \r", &save)) )
+      if ( ! strncmp(tok, "epoch=", 6) )
+	 e = strtoull(tok + 6, NULL, 16);
+      else if ( ! strncmp(tok, "offset=", 7) )
+	 off = strtoll(tok + 7, NULL, 10);
+      else if ( ! strncmp(tok, "filter=", 7) )
+	 spec = tok + 7;
+      else if ( ! strncmp(tok, "compress=", 9) )
+	 packed = tok + 9;
+      else if ( ! strncmp(tok, "caps=", 5) )
+	 for (cap = strtok_r(tok + 5, ",", &csave); cap; cap = strtok_r(NULL, ",", &csave))
+	 {
+	    if ( ! strcmp(cap, "resume") )
+	       resume = 1;
+	    else if ( ! mode && ( ! strcmp(cap, "raw") || ! strcmp(cap, "framed") ) )
+	       mode = cap;
+	 }
+
+   /* a filter: the client has just the records which match it, raw, from
+    * the current point (see write_filtered())
+    */
+
+   if ( spec )
+   {
+      if ( dist || window )
+      {
+	 fprintf(stderr, "filter: not with -D or -F\n");
+	 return -1;
+      }
+      if ( (c->filter = filter_add(spec)) == -1 )
+      {
+	 c->filter = 0;
+	 return -1;
+      }
+      resume = 0;
+   }
+
+   c->framed = mode && ! strcmp(mode, "framed") && ! dist && ! c->filter; // (records are raw, see write_dist())
+
+   /* compression, for a raw stream (if it's built in)
+    */
+
+   if ( packed && ! c->framed && ! c->filter && ! dist && ! window )
+      c->codec = comp_codec(packed);
+
+   start = offset;
+   if ( resume && e == epoch && 0 <= off && off <= offset )
+      start = off < oldest() ? oldest() : off;
+
+   if ( v1 )
+      snprintf(reply, sizeof(reply), "%s epoch=%llx offset=%lld\n", PROTOCOL1, epoch, start);
+   else
+      snprintf(reply, sizeof(reply), "%s mode=%s epoch=%llx offset=%lld caps=%s%s%s%s\n",
+	 PROTOCOL, c->framed ? "framed" : "raw", epoch, start, dist ? "raw" : "raw,framed,resume",
+	 c->filter ? " filter=on" : "", c->codec ? " compress=" : "", c->codec ? packed : "");
+
+   if ( write(c->fd, reply, strlen(reply)) != (int) strlen(reply) )
+      return -1;
+
+   if ( resume && off >= 0 )
+      fprintf(stderr, "resume: %lld (from %lld%s)\n", start, off, e == epoch ? "" : ", another stream");
+   admit(c, start);
+   return 0;
+}
+
+void check_hellos()
+{
+   int i, n, live = 0, pending = 0;
+
+   for (i = 0; i < cnt; i += 1)
+      if ( clients[i].hello )
+	 pending += 1;
+      else
+	 live += 1;
+
+   if ( ! pending )
+      return;
+
+   /* with nothing else to do, wait for a hello (or a timeout)
+    */
+
+   if ( ! live && src == -1 )
+   {
+      struct pollfd pfd[MAXCLIENT];
+      long long wait = HELLOWAIT;
+
+      for (i = n = 0; i < cnt; i += 1)
+      {
+	 pfd[n++] = (struct pollfd) { clients[i].fd, POLLIN, 0 };
+	 if ( clients[i].hello - now_ms() < wait )
+	    wait = clients[i].hello - now_ms();
+      }
+      if ( wait > 0 )
+	 poll(pfd, n, (int) wait);
+   }
+
+   for (i = 0; i < cnt; )
+   {
+      struct client *c = &clients[i];
+
+      if ( ! c->hello )
+      {
+	 i += 1;
+	 continue;
+      }
+
+      n = recv(c->fd, c->line + c->nline, MAXLINE - 1 - c->nline, MSG_DONTWAIT);
+
+      if ( n > 0 )
+	 c->nline += n;
+
+      if ( n == 0 || ( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) )
+      {
+	 drop_client(i);
+	 continue;
+      }
+
+      if ( memchr(c->line, '\n', c->nline) )
+      {
+	 if ( hello(c) == -1 )
+	 {
+	    drop_client(i);
+	    continue;
+	 }
+	 if ( c->codec ) // (the compression thread has it now)
+	 {
+	    fprintf(stderr, "compress: %d/%d --> %d\n", i, cnt, cnt - 1);
+	    comp_add(c);
+	    for (n = i + 1; n < cnt; n += 1)
+	       clients[n - 1] = clients[n];
+	    clients[--cnt].fd = 0;
+	    continue;
+	 }
+      }
+      else if ( c->nline == MAXLINE - 1 )
+      {
+	 drop_client(i);
+	 continue;
+      }
+      else if ( now_ms() >= c->hello )
+      {
+	 if ( c->nline ) // (part of a hello, and no more)
+	 {
+	    drop_client(i);
+	    continue;
+	 }
+	 admit(c, offset); // a raw client: from the current point
+      }
+
+      i += 1;
+   }
+}
+
+/* read a line from <fd> (at most <sz> - 1 bytes, and not beyond the
+ * newline), waiting at most <ms> ms; returns its length or -1
+ */
+
+int read_line(int fd, char *buf, int sz, int ms)
+{
+   struct pollfd pfd = { fd, POLLIN, 0 };
+   int n = 0, r;
+
+   while ( n < sz - 1 )
+   {
+      while ( (r = poll(&pfd, 1, ms)) == -1 && errno == EINTR ) // (the timers)
+	 ;
+      if ( r <= 0 || read(fd, buf + n, 1) != 1 )
+	 return -1;
+      if ( buf[n++] == '\n' )
+      {
+	 buf[n] = 0;
+	 return n;
+      }
+   }
+
+   return -1;
+}
+
+/* does the server on <fd> reply to hellos?  a server from before them
+ * ignores the hello, and just sends the stream, which is left unread (it
+ * is only peeked at); waits at most <ms> ms for the first bytes; returns
+ * 1 (a reply), 0 (the raw stream, or nothing), or -1 (the end)
+ */
+
+int replies(int fd, int ms)
+{
+   struct pollfd pfd = { fd, POLLIN, 0 };
+   char buf[sizeof(PROTOCOL)];
+   int len = strlen("DELIVERY/"), n, r;
+   long long until = now_ms() + ms;
+
+   for (;;)
+   {
+      while ( (r = poll(&pfd, 1, (int) ( until > now_ms() ? until - now_ms() : 0 ))) == -1 && errno == EINTR ) // (the timers)
+	 ;
+      if ( r <= 0 )
+	 return 0;
+      if ( (n = recv(fd, buf, len, MSG_PEEK)) == -1 && errno == EINTR )
+	 continue;
+      if ( n <= 0 )
+	 return -1;
+      if ( memcmp(buf, "DELIVERY/", n) )
+	 return 0;
+      if ( n == len )
+	 return 1;
+      usleep(1000); // (the rest of the prefix is on its way)
+   }
+}
+
+/* send a hello to the server on <fd>, offering <caps>, and asking to
+ * resume stream <e> at <off> (if <e> is non-zero), and for the records
+ * matching <filter> (if any; %-escaped, as the hello is split at spaces);
+ * the server's reply gives the stream and offset of the data which follows;
+ * returns the mode (1 for framed, 0 for raw, as from a server from before
+ * hellos), or -1 on failure
+ */
+
+int say_hello(int fd, char *caps, unsigned long long *e, long long *off)
+{
+   char line[MAXLINE], esc[MAXLINE], *tok, *save, *p;
+   int n, framed = 0, filtered = 0;
+
+   for (n = 0, p = filter; p && *p && n < MAXLINE / 2; p += 1)
+      if ( (unsigned char) *p <= ' ' || *p == '%' || (unsigned char) *p >= 0x7f )
+	 n += sprintf(esc + n, "%%%02x", (unsigned char) *p);
+      else
+	 esc[n++] = *p;
+   esc[n] = 0;
+
+   if ( *e )
+      n = snprintf(line, sizeof(line), "%s caps=%s epoch=%llx offset=%lld", PROTOCOL, caps, *e, *off);
+   else if ( filter )
+      n = snprintf(line, sizeof(line), "%s caps=%s filter=%s", PROTOCOL, caps, esc);
+   else
+      n = snprintf(line, sizeof(line), "%s caps=%s", PROTOCOL, caps);
+   if ( codec && n < (int) sizeof(line) )
+      n += snprintf(line + n, sizeof(line) - n, " compress=%s", codec == COMP_ZSTD ? "zstd" : "lz4");
+   if ( n < (int) sizeof(line) )
+      n += snprintf(line + n, sizeof(line) - n, "\n");
+
+   if ( n >= (int) sizeof(line) )
+      return -1;
+
+   if ( write(fd, line, n) != n || (n = replies(fd, 5000)) == -1 )
+      return -1;
+
+   if ( n == 0 ) // (a server from before hellos: the stream, raw, from the current point)
+   {
+      if ( filter )
+	 fprintf(stderr, "hello: the server does not filter\n");
+      return filter ? -1 : 0;
+   }
+
+   if ( read_line(fd, line, sizeof(line), 5000) == -1 )
+      return -1;
+
+   if ( ! ( tok = strtok_r(line, " \r\n", &save) ) || strcmp(tok, PROTOCOL) )
+      return -1;
+
+   unsigned long long was = *e;
+   long long from = *off;
+
+   while ( (tok = strtok_r(NULL, " \r\n", &save)) )
+      if ( ! strncmp(tok, "epoch=", 6) )
+	 *e = strtoull(tok + 6, NULL, 16);
+      else if ( ! strncmp(tok, "offset=", 7) )
+	 *off = strtoll(tok + 7, NULL, 10);
+      else if ( ! strncmp(tok, "mode=", 5) )
+	 framed = ! strcmp(tok + 5, "framed");
+      else if ( ! strcmp(tok, "filter=on") )
+	 filtered = 1;
+      else if ( ! strncmp(tok, "compress=", 9) )
+	 unpacking = codec && codec == comp_codec(tok + 9);
+
+   if ( filter && ! filtered )
+   {
+      fprintf(stderr, "hello: the server does not filter\n");
+      return -1;
+   }
+
+   if ( was && was != *e )
+      fprintf(stderr, "resume: new stream (the server has restarted)\n");
+   else if ( was && *off != from )
+      fprintf(stderr, "resume: gap of %lld bytes\n", *off - from);
+
+   return framed;
+}
+
+/* ************************************************************************
+ */
+
+void reopen_src(int s)
+{
+   fprintf(stderr, "signal %d (reopen_src)\n", s);
+   if ( ( src != -1 || upstream ) && ! ( input && ! strcmp(input, "-") ) ) // (a relay reconnecting retries at once)
+      reopen = 1;
+}
+
+void unmap_src();
+
+void close_src()
+{
+   if ( src != -1 && input )
+   {
+      if ( src_map )
+	 unmap_src();
+      if ( src != STDIN_FILENO )
+	 close(src);
+      src = -1;
+   }
+   if ( src != -1 && upstream )
+   {
+      close(src);
+      src = -1;
+   }
+   if ( src != -1 )
+   {
+      close(src);
+      stop_src(src_pid);
+      src = -1;
+   }
+   if ( next_src != -1 )
+   {
+      close(next_src);
+      stop_src(next_pid);
+      next_src = -1;
+   }
+   if ( sb_src != -1 )
+   {
+      close(sb_src);
+      stop_src(sb_pid);
+      sb_src = -1;
+   }
+   if ( pl_next != -1 )
+   {
+      close(pl_next);
+      stop_src(pl_next_pid);
+      pl_next = -1;
+   }
+   on_backup = 0;
+   reopen = 0;
+}
+
+char *print(char *prev, const char *format, ...) {
+   char *cp = 0;
+   va_list ap;
+   va_start(ap,format);
+   if ( ! vasprintf(&cp, format, ap) )
+      perror("vasprintf failed)");
+   if ( ! cp )
+      perror("vasprintf/malloc failed)");
+   va_end(ap);
+   if ( prev )
+      free(prev);
+   return cp;
+}
+
+/* wait until <until> (ms), as wait_for() waits for a source: handling
+ * signals, and taking in clients and their hellos; clients which go
+ * meanwhile are dropped, so that demand() is up to date; returns early if
+ * there is no longer demand, or on SIGHUP
+ */
+
+void backoff_wait(long long until)
+{
+   struct pollfd pfd[3 + MAXCLIENT];
+   long long wait;
+   int k, n, base;
+
+   while ( (wait = until - now_ms()) > 0 && ! reopen && demand() )
+   {
+      n = 0;
+      pfd[n++] = (struct pollfd) { sig_fd, POLLIN, 0 };
+      if ( src_fd )
+	 pfd[n++] = (struct pollfd) { src_fd, POLLIN, 0 };
+      if ( tcp_fd )
+	 pfd[n++] = (struct pollfd) { tcp_fd, POLLIN, 0 };
+      for (k = 0, base = n; k < cnt; k += 1)
+      {
+	 pfd[n++] = (struct pollfd) { clients[k].fd, clients[k].hello ? POLLIN : POLLRDHUP, 0 };
+	 if ( clients[k].hello && clients[k].hello - now_ms() < wait )
+	    wait = clients[k].hello > now_ms() ? clients[k].hello - now_ms() : 0;
+      }
+
+      if ( poll(pfd, n, (int) wait) == -1 && errno != EINTR )
+	 die("poll", errno);
+      if ( pfd[0].revents )
+	 signals();
+      for (k = cnt - 1; k >= 0; k -= 1) // (from the end, as drop_client() moves those after)
+	 if ( ! clients[k].hello && pfd[base + k].revents )
+	    drop_client(k);
+      if ( src_fd )
+	 accept_clients(src_fd);
+      if ( tcp_fd )
+	 accept_clients(tcp_fd);
+      check_hellos();
+   }
+}
+
+/* relay mode: connect to the upstream server, retrying with exponential
+ * backoff until it becomes available (or there's no longer anyone to
+ * relay to: then src is left closed)
+ */
+
+void open_upstream()
+{
+   int fd, backoff = 100;
+
+   reopen = 0;
+   while ( (fd = connect_to(upstream)) == -1 || say_hello(fd, "framed,resume", &up_epoch, &up_offset) != 1 )
+   {
+      if ( fd != -1 )
+      {
+	 close(fd);
+	 errno = EPROTO;
+      }
+      fprintf(stderr, "upstream %s: %s (retry in %dms)\n", upstream, strerror(errno), backoff);
+      backoff_wait(now_ms() + backoff);
+      if ( ! demand() )
+	 return;
+      if ( reopen )
+      {
+	 reopen  = 0;
+	 backoff = 100;
+      }
+      else if ( (backoff *= 2) > MAXBACKOFF )
+	 backoff = MAXBACKOFF;
+   }
+
+   fprintf(stderr, "upstream: %s\n", upstream);
+   up_left = 0;
+   src = fd;
+}
+
+/* does the command need a shell?  (arguments containing shell syntax, or a
+ * single argument which is a whole command line, as in "delivery 'lame -
+ * -'")
+ */
+
+int needs_shell(char *argv[])
+{
+   for (i = 0; argv[i]; i += 1)
+      if ( strpbrk(argv[i], " \t\n|&;<>()$`\\\"'*?[]#~={}") )
+	 return 1;
+   return 0;
+}
+
+/* run the command with a pipe as its standard output: directly from argv
+ * if possible, otherwise (as popen() would) with "sh -c"; posix_spawn()
+ * uses vfork(), so nothing is copied
+ */
+
+int spawn_src(char *argv[], pid_t *pid)
+{
+   posix_spawn_file_actions_t fa;
+   posix_spawnattr_t attr;
+   sigset_t dfl, none;
+   char *sh[] = { "sh", "-c", 0, 0 };
+   size_t len;
+   int p[2];
+
+   if ( pipe2(p, O_CLOEXEC) == -1 )
+      die("pipe2", errno);
+   fcntl(p[0], F_SETPIPE_SZ, SRCPIPE);
+
+   posix_spawn_file_actions_init(&fa);
+   posix_spawn_file_actions_adddup2(&fa, p[1], STDOUT_FILENO);
+
+   /* the server ignores SIGPIPE, and blocks its other signals (reading them
+    * from sig_fd); the source should do neither; and the source is a
+    * process group of its own, so that the whole of a pipeline (or the
+    * children of "sh -c") can be killed, as kill(-pid)
+    */
+   sigemptyset(&dfl);
+   sigemptyset(&none);
+   sigaddset(&dfl, SIGPIPE);
+   posix_spawnattr_init(&attr);
+   posix_spawnattr_setsigdefault(&attr, &dfl);
+   posix_spawnattr_setsigmask(&attr, &none);
+   posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+   if ( needs_shell(argv) )
+   {
+      for (i=0, len=1; argv[i]; i+=1)
+	 len += strlen(argv[i]) + 1;
+      if ( ! (sh[2] = cp = malloc(len)) )
+	 die("malloc", errno);
+      for (i=0, *cp=0; argv[i]; i+=1)
+	 cp = stpcpy(i ? stpcpy(cp, " ") : cp, argv[i]);
+      cp = sh[2];
+      fprintf(stderr, "spawn: sh -c %s\n", cp);
+      err = posix_spawn(pid, "/bin/sh", &fa, &attr, sh, environ);
+      free(cp);
+   }
+   else
+   {
+      fprintf(stderr, "spawn: %s\n", argv[0]);
+      err = posix_spawnp(pid, argv[0], &fa, &attr, argv, environ);
+   }
+
+   posix_spawn_file_actions_destroy(&fa);
+   posix_spawnattr_destroy(&attr);
+   close(p[1]);
+
+   if ( err )
+      die(argv[0], err);
+   mk_nonblocking(p[0]);
+   return p[0];
+}
+
+/* native sources (-i): "-" (standard input), a device, a FIFO, a regular
+ * file (mapped, so chunks point straight into the page cache), a Unix
+ * domain socket, or HOST:PORT (TCP); no process, and no pipe
+ */
+
+void open_input()
+{
+   struct stat sb;
+
+   src_map = 0;
+   src_pos = 0;
+
+   if ( ! strcmp(input, "-") )
+   {
+      if ( reopen )
+	 fprintf(stderr, "input: standard input cannot be reopened\n");
+      src = STDIN_FILENO;
+      return;
+   }
+
+   if ( stat(input, &sb) == -1 )
+   {
+      if ( ! strchr(input, ':') || (src = connect_to(input)) == -1 )
+	 die(input, errno);
+      fprintf(stderr, "input: tcp %s\n", input);
+      return;
+   }
+
+   if ( S_ISSOCK(sb.st_mode) )
+   {
+      if ( (src = connect_to(input)) == -1 )
+	 die(input, errno);
+      fprintf(stderr, "input: socket %s\n", input);
+      return;
+   }
+
+   if ( (src = open(input, O_RDONLY | O_CLOEXEC)) == -1 )
+      die(input, errno);
+
+   if ( S_ISREG(sb.st_mode) && sb.st_size > 0 )
+   {
+      src_map = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_SHARED, src, 0);
+      if ( src_map == MAP_FAILED )
+	 die("mmap", errno);
+      madvise(src_map, (size_t) sb.st_size, MADV_SEQUENTIAL);
+      src_size = sb.st_size;
+   }
+
+   fprintf(stderr, "input: %s %s\n", S_ISREG(sb.st_mode) ? "file" : S_ISFIFO(sb.st_mode) ? "fifo" : "device", input);
+}
+
+/* a mapped source is being closed: chunks which still point into the
+ * mapping get copies of their data
+ */
+
+void unmap_src()
+{
+   if ( ring )
+      for (i = 0; i < nchunk; i += 1)
+      {
+	 if ( ring[i].data == ring_mem + (size_t) i * bufsz )
+	    continue;
+	 if ( ring[i].zc )
+	    zc_wait(i);
+	 memcpy(ring_mem + (size_t) i * bufsz, ring[i].data, ring[i].len);
+	 ring[i].data = ring_mem + (size_t) i * bufsz;
+      }
+
+   munmap(src_map, (size_t) src_size);
+   src_map = 0;
+}
+
+/* the playlist (-P): read it (again), skipping blank lines and comments
+ */
+
+void pl_load()
+{
+   FILE *fp;
+   char line[4096];
+   int k;
+
+   for (k = 0; k < pl_count; k += 1)
+      free(pl_items[k]);
+   pl_count = 0;
+
+   if ( ! (fp = fopen(playlist, "r")) )
+      die(playlist, errno);
+   while ( fgets(line, sizeof(line), fp) )
+   {
+      line[strcspn(line, "\r\n")] = 0;
+      if ( ! line[strspn(line, " \t")] || line[strspn(line, " \t")] == '#' )
+	 continue;
+      if ( ! (pl_items = realloc(pl_items, ( pl_count + 1 ) * sizeof(*pl_items))) )
+	 die("realloc", errno);
+      pl_items[pl_count++] = strdup(line);
+   }
+   fclose(fp);
+
+   if ( ! pl_count )
+      die("empty playlist", EINVAL);
+}
+
+/* open the playlist's source <k>: a regular file is read directly, anything
+ * else is a command
+ */
+
+int pl_open(int k, pid_t *pid)
+{
+   struct stat sb;
+   char *argv[] = { pl_items[k], 0 };
+   int fd;
+
+   fprintf(stderr, "playlist: %d: %s\n", k + 1, pl_items[k]);
+   *pid = 0;
+   if ( stat(pl_items[k], &sb) == 0 && S_ISREG(sb.st_mode) )
+   {
+      if ( (fd = open(pl_items[k], O_RDONLY | O_CLOEXEC)) == -1 )
+	 die(pl_items[k], errno);
+      return fd;
+   }
+
+   return spawn_src(argv, pid);
+}
+
+/* open the source after the current one (if there is one) ahead of time
+ */
+
+void pl_ahead()
+{
+   if ( (pl_next_idx = pl_idx + 1) == pl_count )
+   {
+      if ( ! pl_loop )
+	 return;
+      pl_load();
+      pl_next_idx = 0;
+   }
+
+   pl_next = pl_open(pl_next_idx, &pl_next_pid);
+}
+
+/* move on to the next source (at the end of the current one, or on "-r");
+ * returns -1 at the end of the playlist
+ */
+
+int pl_advance()
+{
+   if ( pl_next == -1 )
+      return -1;
+
+   close(src);
+   stop_src(src_pid);
+
+   src       = pl_next;
+   src_pid   = pl_next_pid;
+   pl_idx    = pl_next_idx;
+   src_start = offset;
+   pl_next   = -1;
+   if ( src != STDIN_FILENO )
+      mk_nonblocking(src);
+   pl_ahead();
+   return 0;
+}
+
+/* restart (make before break): a command source is restarted by starting
+ * the new one alongside the old; read_buf() switches to it when it produces
+ * data
+ */
+
+void open_src(char *argv[])
+{
+   /* running on the backup: keep trying to restart the primary
+    */
+   if ( on_backup && next_src == -1 && now_ms() >= sb_retry )
+   {
+      reopen   = 1;
+      sb_retry = now_ms() + RETRYWAIT;
+   }
+
+   if ( reopen && src != -1 && playlist )
+   {
+      reopen = 0;
+      if ( pl_advance() == -1 )
+	 fprintf(stderr, "playlist: nothing to skip to\n");
+   }
+
+   if ( reopen && src != -1 && ! upstream && ! input )
+   {
+      reopen = 0;
+      if ( next_src == -1 )
+      {
+	 next_src = spawn_src(argv, &next_pid);
+	 fprintf(stderr, "restart: waiting for source %d\n", (int) next_pid);
+      }
+   }
+
+   if ( reopen || ! demand() ) close_src();
+   if ( src != -1 || ! demand() ) return;
+
+   src_start = offset;
+   if ( upstream )
+   {
+      open_upstream();
+      if ( src == -1 ) // (no one left to relay to)
+	 return;
+   }
+   else if ( input )
+      open_input();
+   else if ( playlist )
+   {
+      if ( ! pl_count )
+	 pl_load();
+      src = pl_open(pl_idx < pl_count ? pl_idx : 0, &src_pid);
+      pl_ahead();
+   }
+   else
+      src = spawn_src(argv, &src_pid);
+
+   /* reads from the source do not block: when there is nothing to read,
+    * the server waits in wait_for() (and handles its signals); standard
+    * input is not ours to change, so it is waited for first
+    */
+   if ( src != STDIN_FILENO )
+      mk_nonblocking(src);
+}
+
+/* derived pipelines (-X): each is a delivery server of its own (this
+ * program, again, with "-X <name>", so "<basename>.<name>"), with a client
+ * of this server, through the command, as its source; so it starts (and
+ * stops) that client as its clients come and go, and it does not exit when
+ * the last goes; its standard output is /dev/null
+ */
+
+void derived_start(int k)
+{
+   static char exe[PATH_MAX];
+   posix_spawn_file_actions_t fa;
+   posix_spawnattr_t attr;
+   sigset_t dfl, none;
+   char *p, *q, *src_cmd, *argv[8];
+   size_t len;
+   int n = 0, err;
+
+   if ( ! *exe && readlink("/proc/self/exe", exe, sizeof(exe) - 1) == -1 )
+      die("/proc/self/exe", errno);
+
+   /* the source: "exec <exe> -n <basename> -c sh -c '<command>'" (with each
+    * quote in the command as '\'', so at most four bytes for each)
+    */
+
+   len = strlen(exe) + strlen(tmpbasename) + 4 * strlen(dv_cmd[k]) + 32;
+   if ( ! (src_cmd = malloc(len)) )
+      die("malloc", errno);
+   q = src_cmd + sprintf(src_cmd, "exec '%s' -n '%s' -c sh -c '", exe, tmpbasename);
+   for (p = dv_cmd[k]; *p; p += 1)
+      if ( *p == '\'' )
+	 q = stpcpy(q, "'\\''");
+      else
+	 *q++ = *p;
+   strcpy(q, "'");
+
+   argv[n++] = exe;
+   if ( world )
+      argv[n++] = "-w";
+   argv[n++] = "-n";
+   argv[n++] = tmpbasename;
+   argv[n++] = "-X";
+   argv[n++] = dv_name[k];
+   argv[n++] = src_cmd;
+   argv[n]   = 0;
+
+   posix_spawn_file_actions_init(&fa);
+   posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+   sigemptyset(&dfl); // (as a source, see spawn_src())
+   sigemptyset(&none);
+   sigaddset(&dfl, SIGPIPE);
+   posix_spawnattr_init(&attr);
+   posix_spawnattr_setsigdefault(&attr, &dfl);
+   posix_spawnattr_setsigmask(&attr, &none);
+   posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+   err = posix_spawn(&dv_pid[k], exe, &fa, &attr, argv, environ);
+   posix_spawn_file_actions_destroy(&fa);
+   posix_spawnattr_destroy(&attr);
+   if ( err )
+      die("derived", err);
+
+   fprintf(stderr, "derived: %s (%s), server %d\n", dv_name[k], dv_cmd[k], (int) dv_pid[k]);
+   dv_start[k] = now_ms();
+   free(src_cmd);
+}
+
+/* a derived server has gone: restart it, unless it did not last (or this
+ * server is exiting)
+ */
+
+void derived_gone(pid_t pid)
+{
+   int k;
+
+   for (k = 0; k < nderived; k += 1)
+      if ( dv_pid[k] != pid )
+	 continue;
+      else if ( exiting || now_ms() - dv_start[k] < DERIVEDUP )
+      {
+	 if ( ! exiting )
+	    fprintf(stderr, "derived: %s has failed\n", dv_name[k]);
+	 dv_pid[k] = 0;
+      }
+      else
+	 derived_start(k);
+}
+
+/* at exit, stop the derived servers; at the end of the stream (<drain>),
+ * their sources (our clients) are given the end of it first, and they have
+ * DERIVEDDRAIN ms to pass on the rest of their output, and finish
+ */
+
+void derived_stop(int drain)
+{
+   struct pollfd pfd = { sig_fd, POLLIN, 0 };
+   long long until = now_ms() + DERIVEDDRAIN;
+   int k, left = 0;
+
+   if ( nderived == 0 )
+      return;
+
+   exiting = 1;
+   for (k = 0; drain && k < cnt; k += 1)
+      shutdown(clients[k].fd, SHUT_WR);
+   for (k = 0; drain && k < nderived; k += 1)
+      left += dv_pid[k] > 0;
+
+   while ( left && now_ms() < until )
+   {
+      if ( poll(&pfd, 1, (int) ( until - now_ms() )) > 0 )
+	 signals();
+      for (k = left = 0; k < nderived; k += 1)
+	 left += dv_pid[k] > 0;
+   }
+
+   for (k = 0; k < nderived; k += 1)
+      stop_src(dv_pid[k]);
+}
+
+/* the standby (-B): started with the source (or soon after it fails), and
+ * kept running, ready for failover
+ */
+
+void open_standby()
+{
+   char *sb_argv[] = { backup, 0 };
+
+   if ( ! backup || sb_src != -1 || on_backup || src == -1 || now_ms() < sb_retry )
+      return;
+
+   sb_src = spawn_src(sb_argv, &sb_pid);
+   fprintf(stderr, "standby: source %d\n", (int) sb_pid);
+}
+
+/* discard the standby's output; if it has gone, it is restarted later
+ */
+
+void drain_standby()
+{
+   static char scratch[1 << 16];
+   int n;
+
+   if ( (n = read(sb_src, scratch, sizeof(scratch))) > 0 || ( n == -1 && ( errno == EINTR || errno == EAGAIN ) ) )
+      return;
+
+   fprintf(stderr, "standby: source %d has gone\n", (int) sb_pid);
+   close(sb_src);
+   sb_src   = -1;
+   sb_retry = now_ms() + RETRYWAIT;
+}
+
+/* with a standby: wait for the source to have data, draining the standby
+ * meanwhile; returns -1 if the source stalls
+ */
+
+int watch_src()
+{
+   struct pollfd pfd[3] = { { src, POLLIN, 0 }, { sb_src, POLLIN, 0 }, { sig_fd, POLLIN, 0 } };
+   long long until = now_ms() + stall_ms;
+
+   for (;;)
+   {
+      if ( poll(pfd, 3, (int) ( until - now_ms() > 0 ? until - now_ms() : 0 )) == -1 && errno != EINTR )
+	 die("poll", errno);
+
+      if ( pfd[2].revents )
+	 signals();
+
+      if ( wd_fired )
+	 return -1;
+
+      if ( pfd[1].revents )
+      {
+	 drain_standby();
+	 pfd[1].fd = sb_src;
+      }
+
+      if ( pfd[0].revents )
+	 return 0;
+
+      if ( now_ms() >= until )
+	 return -1;
+   }
+}
+
+/* the source has ended or stalled: switch to the standby, and restart the
+ * source in the background; when it produces data, switch_src() switches
+ * back (and the backup is the standby once more)
+ */
+
+void failover(char *why)
+{
+   fprintf(stderr, "failover (%s): from source %d to standby %d\n", why, (int) src_pid, (int) sb_pid);
+   close(src);
+   stop_src(src_pid);
+
+   src       = sb_src;
+   src_pid   = sb_pid;
+   src_start = offset;
+   sb_src    = -1;
+   stalled   = 0;
+   on_backup = 1;
+   sb_retry  = 0;
+   failovers += 1;
+}
+
+/* the offset of the first frame boundary in <buf>, or -1
+ */
+
+int frame_sync(unsigned char *buf, int len)
+{
+   int k;
+
+   for (k = 0; k < len; k += 1)
+      if ( align == ALIGN_TS )
+      {
+	 if ( buf[k] == 0x47 && ( k + TSPACKET >= len || buf[k + TSPACKET] == 0x47 ) )
+	    return k;
+      }
+      else if ( k + 2 < len && buf[k] == 0xff && ( buf[k+1] & 0xe0 ) == 0xe0
+		&& ( buf[k+1] >> 3 & 3 ) != 1 && ( buf[k+1] >> 1 & 3 ) != 0
+		&& ( buf[k+2] >> 4 ) != 15 && ( buf[k+2] >> 2 & 3 ) != 3 )
+	 return k;
+
+   return -1;
+}
+
+/* restarting: has the new source produced data?  if so, returns the number
+ * of bytes still to be read from the old one (to finish its last transport
+ * stream packet), or 0 to switch now; if not, returns -1; this blocks until
+ * one or the other has data
+ */
+
+int restart_due()
+{
+   struct pollfd pfd[3] = { { src, POLLIN, 0 }, { next_src, POLLIN, 0 }, { sig_fd, POLLIN, 0 } };
+
+   do
+   {
+      if ( poll(pfd, 3, -1) == -1 && errno != EINTR )
+	 die("poll", errno);
+      if ( pfd[2].revents )
+	 signals();
+   }
+   while ( ! pfd[0].revents && ! pfd[1].revents && ! wd_fired );
+
+   if ( ! pfd[1].revents )
+      return -1;
+
+   if ( align == ALIGN_TS )
+      return (int) ( ( TSPACKET - ( offset - src_start ) % TSPACKET ) % TSPACKET );
+   return 0;
+}
+
+/* read a source's first data into <buffer>, from its first frame boundary
+ * (with alignment); returns the number of bytes there, or 0 at the end of
+ * the source
+ */
+
+int first_data(int fd)
+{
+   int n, k;
+
+   do
+   {
+      while ( (n = read(fd, buffer, bufsz)) == -1 && ( errno == EINTR || errno == EAGAIN ) )
+	 if ( errno == EAGAIN && wait_for(fd) )
+	    return 0;
+      if ( n <= 0 )
+	 return 0;
+      k = align ? frame_sync((unsigned char *) buffer, n) : 0;
+   }
+   while ( k == -1 );
+
+   memmove(buffer, buffer + k, n - k);
+   return n - k;
+}
+
+/* switch to the new source, the first data from which is read into
+ * <buffer>; the old one is told to go, and reaped by reap(); returns
+ * the number of bytes in <buffer>, or -1 if the new source has failed (and
+ * the old one carries on)
+ */
+
+int switch_src()
+{
+   int n;
+
+   if ( ! (n = first_data(next_src)) )
+   {
+      fprintf(stderr, "restart: source %d failed, carrying on with %d\n", (int) next_pid, (int) src_pid);
+      close(next_src);
+      stop_src(next_pid);
+      next_src = -1;
+      return -1;
+   }
+
+   fprintf(stderr, "restart: switching from source %d to %d\n", (int) src_pid, (int) next_pid);
+   if ( on_backup && sb_src == -1 )
+   {
+      fprintf(stderr, "standby: source %d\n", (int) src_pid);
+      sb_src    = src;
+      sb_pid    = src_pid;
+      on_backup = 0;
+   }
+   else
+   {
+      close(src);
+      stop_src(src_pid);
+   }
+
+   src       = next_src;
+   src_pid   = next_pid;
+   src_start = offset;
+   next_src  = -1;
+   return n;
+}
+
+/* ************************************************************************
+ */
+
+void alloc_ring()
+{
+   /* choose a size for the read/write buffer and allocate space
+    *   (not sure why we're bothering with this; might as well just choose
+    *   bufsz = 4096 and be done)
+    */
+   struct stat sb;
+
+   if ( bufsz == 0 && zerocopy )
+      bufsz = 65536;
+
+   if ( bufsz == 0 )
+   {
+      if ( ( bufsz = (int) sysconf(_SC_PAGESIZE) ) == -1 )
+	 die("sysconf", errno);
+
+      if ( fstat(src, &sb) == -1 )
+	 die("stat", errno);
+
+      if ( sb.st_blksize > bufsz )
 	 bufsz = sb.st_blksize;
+   }
+
+   fprintf(stderr, "bufsz: %d\n", bufsz);
+
+   if ( bufsz <= 0 )
+      die("bufsz", EINVAL);
+
+   /* with zerocopy, the ring must be large enough that a chunk's sends have
+    * normally completed by the time it comes round again
+    */
+
+   nchunk = zerocopy ? ZCRING / bufsz : 1;
+   if ( nchunk < 4 && zerocopy )
+      nchunk = 4;
+   if ( history && nchunk < history / bufsz + 2 )
+      nchunk = history / bufsz + 2;
+   if ( window && nchunk < window / bufsz + 2 )
+      nchunk = window / bufsz + 2;
+
+   if ( ! ( ring = calloc(nchunk, sizeof(*ring)) ) )
+      die("calloc", errno);
+
+   ring_mem = mmap(NULL, (size_t) nchunk * bufsz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if ( ring_mem == MAP_FAILED )
+      die("mmap", errno);
+
+   if ( zerocopy && mlock(ring_mem, (size_t) nchunk * bufsz) )
+      fprintf(stderr, "mlock: %s (ring not pinned)\n", strerror(errno));
+
+   for (i = 0; i < nchunk; i += 1)
+      ring[i].data = ring_mem + (size_t) i * bufsz;
+
+   head = nchunk - 1;
+}
+
+int src_lost(char *what);
+int up_frame();
+
+/* ************************************************************************
+ * real-time pacing (-R): a source which is faster than real time (a file,
+ * or a transcoder) is held to the content's own clock: a chunk is released
+ * when the clock reaches it (less PACEAHEAD, so clients keep a little in
+ * hand); the clock runs at the given bitrate, or by the durations of MPEG
+ * audio frames, or by an MPEG transport stream's PCR
+ */
+
+long long mono_ns()
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the length (bytes) and duration (ns) of the MPEG audio frame with header
+ * <h>; 0 if <h> is not a frame header
+ */
+
+int mp3_frame(unsigned char *h, long long *ns)
+{
+   static const short kbps[5][16] = {
+      { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 }, // MPEG 1, layer I
+      { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },    // layer II
+      { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },     // layer III
+      { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },    // MPEG 2/2.5, layer I
+      { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 } };       // layers II and III
+   static const int hz[3] = { 44100, 48000, 32000 };
+   int version = h[1] >> 3 & 3, layer = 4 - ( h[1] >> 1 & 3 ), pad = h[2] >> 1 & 1;
+   int br, sr, samples;
+
+   if ( h[0] != 0xff || ( h[1] & 0xe0 ) != 0xe0 || version == 1 || layer == 4 || ( h[2] >> 2 & 3 ) == 3 )
+      return 0;
+   if ( ! (br = kbps[version == 3 ? layer - 1 : layer == 1 ? 3 : 4][h[2] >> 4]) || ( h[2] >> 4 ) == 15 )
+      return 0; // (free format, or invalid)
+
+   sr      = hz[h[2] >> 2 & 3] >> ( version == 3 ? 0 : version == 2 ? 1 : 2 );
+   samples = layer == 1 ? 384 : layer == 3 && version != 3 ? 576 : 1152;
+   *ns     = samples * 1000000000LL / sr;
+
+   if ( layer == 1 )
+      return ( 12 * br * 1000 / sr + pad ) * 4;
+   return samples / 8 * br * 1000 / sr + pad;
+}
+
+/* the duration of the MPEG audio frames starting in <p> (frames and their
+ * headers span chunks)
+ */
+
+long long mp3_clock(unsigned char *p, int len)
+{
+   static unsigned char h[4];
+   static int nh, skip;
+   long long ns = 0, dur;
+   int k = 0, n;
+
+   while ( k < len )
+   {
+      if ( skip )
+      {
+	 n = skip < len - k ? skip : len - k;
+	 skip -= n;
+	 k    += n;
+	 continue;
+      }
+
+      h[nh++] = p[k++];
+      if ( nh < 4 )
+	 continue;
+
+      if ( (n = mp3_frame(h, &dur)) > 4 )
+      {
+	 ns  += dur;
+	 skip = n - 4;
+	 nh   = 0;
+      }
+      else // hunt for the next header
+      {
+	 memmove(h, h + 1, 3);
+	 nh = 3;
+      }
+   }
+
+   return ns;
+}
+
+/* an MPEG transport stream: the content's clock follows the PCR (of the
+ * first PID to carry one); a PCR which goes back, or jumps by more than a
+ * second, is a discontinuity (a new source, perhaps), and the clock carries
+ * on from where it was
+ */
+
+void ts_clock(unsigned char *p, int len)
+{
+   static unsigned char h[12];
+   static int nh, skip, pcr_pid = -1;
+   static long long pcr0, pcr_last = -1, base;
+   long long pcr;
+   int k = 0, n;
+
+   while ( k < len )
+   {
+      if ( skip )
+      {
+	 n = skip < len - k ? skip : len - k;
+	 skip -= n;
+	 k    += n;
+	 continue;
+      }
+
+      if ( ! nh && p[k] != 0x47 )
+      {
+	 k += 1;
+	 continue;
+      }
+      h[nh++] = p[k++];
+      if ( nh < 12 )
+	 continue;
+
+      nh   = 0;
+      skip = TSPACKET - 12;
+
+      /* adaptation field, with a PCR
+       */
+      if ( ! ( h[3] & 0x20 ) || h[4] < 7 || ! ( h[5] & 0x10 ) )
+	 continue;
+      if ( pcr_pid == -1 )
+	 pcr_pid = ( h[1] & 0x1f ) << 8 | h[2];
+      if ( ( ( h[1] & 0x1f ) << 8 | h[2] ) != pcr_pid )
+	 continue;
+
+      pcr = ( (long long) h[6] << 25 | h[7] << 17 | h[8] << 9 | h[9] << 1 | h[10] >> 7 ) * 300 + ( ( h[10] & 1 ) << 8 | h[11] );
+      if ( pcr_last == -1 || pcr < pcr_last || pcr - pcr_last > 27000000 )
+      {
+	 pcr0 = pcr;
+	 base = pace_pos;
+      }
+      pace_pos = base + ( pcr - pcr0 ) * 1000 / 27;
+      pcr_last = pcr;
+   }
+}
+
+/* wait (handling signals meanwhile) until CLOCK_MONOTONIC <at> (ns)
+ */
+
+void pace_wait(long long at)
+{
+   struct itimerspec it = { { 0, 0 }, { at / 1000000000, at % 1000000000 } };
+   struct pollfd pfd[2] = { { 0, POLLIN, 0 }, { sig_fd, POLLIN, 0 } };
+   unsigned long long expired;
+
+   if ( pace_fd == -1 && (pace_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1 )
+      die("timerfd_create", errno);
+   pfd[0].fd = pace_fd;
+   timerfd_settime(pace_fd, TFD_TIMER_ABSTIME, &it, NULL);
+
+   for (;;)
+   {
+      if ( poll(pfd, 2, -1) == -1 && errno != EINTR )
+	 die("poll", errno);
+      if ( pfd[1].revents )
+	 signals();
+      if ( pfd[0].revents && read(pace_fd, &expired, sizeof(expired)) > 0 )
+	 return;
+   }
+}
+
+/* the chunk <p> (<len> bytes) is next: wait for its time to come
+ */
+
+void pace_out(unsigned char *p, int len)
+{
+   long long start = pace_pos, now = mono_ns();
+
+   if ( pace == PACE_RATE )
+      pace_pos += len * 8000000000LL / pace_bps;
+   else if ( pace == PACE_MP3 )
+      pace_pos += mp3_clock(p, len);
+   else
+      ts_clock(p, len);
+
+   /* starting (or behind, after a stall, or while there was no source):
+    * from now, rather than catching up
+    */
+   if ( ! pace_t0 || now - ( pace_t0 + start ) > PACESLACK * 1000000LL )
+      pace_t0 = now - start;
+
+   if ( pace_t0 + start - PACEAHEAD * 1000000LL > now )
+      pace_wait(pace_t0 + start - PACEAHEAD * 1000000LL);
+}
+
+/* read <len> bytes from the source (fewer only at its end, or on error)
+ */
+
+int read_src(char *buf, int len)
+{
+   int n, nr;
+
+   for (n = 0; n < len; n += nr)
+      if ( reopen )
+	 break;
+      else if ( stalled || ( sb_src != -1 && ( stalled = watch_src() ) ) || wd_fired || ( src == STDIN_FILENO && wait_for(src) ) )
+      {
+	 errno = ETIMEDOUT;
+	 break;
+      }
+      else if ( (nr = read(src, buf + n, len - n)) <= 0 )
+      {
+	 if ( nr == -1 && ( errno == EINTR || errno == EAGAIN ) )
+	 {
+	    if ( errno == EAGAIN )
+	       wait_for(src);
+	    nr = 0;
+	    continue;
+	 }
+	 if ( nr == 0 )
+	    errno = 0;
+	 break;
+      }
+
+   return n;
+}
+
+int read_buf()
+{
+   assert(src != -1);
+
+   if ( ring == NULL )
+      alloc_ring();
+
+   /* move on to the next chunk, first waiting for the kernel to finish
+    * with it
+    */
+
+   head = ( head + 1 ) % nchunk;
+   if ( ring[head].zc )
+      zc_wait(head);
+   buffer = ring[head].data = ring_mem + (size_t) head * bufsz;
+
+   ring[head].len = 0;
+
+   /* a mapped file: the chunk is the file's data, in place
+    */
+
+   if ( src_map )
+   {
+      if ( src_pos >= src_size )
+      {
+	 errno = 0;
+	 return src_lost("end of file");
+      }
+
+      int len = src_size - src_pos < bufsz ? (int) ( src_size - src_pos ) : bufsz;
+
+      if ( pace )
+	 pace_out((unsigned char *) src_map + src_pos, len);
+      buffer = ring[head].data = src_map + src_pos;
+      ring[head].off = offset;
+      ring[head].len = len;
+      ring[head].ts  = now_ns();
+      offset  += len;
+      src_pos += len;
+      return 1;
+   }
+
+   int len = upstream ? up_frame() : bufsz, carry = 0, n = 0;
+   if ( len <= 0 )
+      return src_lost("read");
+
+   /* restarting: finish with the old source (perhaps reading just the rest
+    * of its last packet), or switch to the new one, whose first data is
+    * then at the start of the buffer
+    */
+
+   if ( next_src != -1 && (n = restart_due()) >= 0 )
+   {
+      if ( n )
+	 len = n;
+      else if ( (n = switch_src()) > 0 )
+	 carry = n;
+   }
+   else if ( align && offset == src_start && ! upstream )
+      carry = first_data(src);
+
+   /* a short read is the end of the source; pass on what there is (a relay
+    * will see the rest of the frame again when it resumes)
+    */
+
+   n = carry < len ? read_src(buffer + carry, len - carry) : 0;
+   if ( (len = carry + n) <= 0 && reopen )
+      return 0; // restarting (SIGHUP) while waiting for data
+   if ( len <= 0 || ( upstream && len < up_left && len < bufsz ) )
+      return src_lost(stalled ? "stalled" : "read");
+
+   if ( pace )
+      pace_out((unsigned char *) buffer, len);
+
+   ring[head].off = offset;
+   ring[head].len = len;
+   ring[head].ts  = upstream ? up_ts : now_ns();
+   offset += len;
+   if ( upstream )
+   {
+      up_offset += len;
+      up_left   -= len;
+   }
+
+   return 1;
+}
+
+/* relay: the upstream is framed; read the next header if necessary, and
+ * return the number of bytes of the current frame to read next (at most
+ * bufsz), or -1
+ */
+
+int up_frame()
+{
+   unsigned char h[FRAMEHDR];
+   long long seq;
+
+   while ( up_left == 0 )
+   {
+      if ( read_src((char *) h, FRAMEHDR) != FRAMEHDR )
+	 return -1;
+
+      up_left = (int) get_be(h, 4);
+      up_ts   = (long long) get_be(h + 16, 8);
+
+      if ( get_be(h + 4, 4) != 'D' )
+      {
+	 for (; up_left; up_left -= err)
+	    if ( (err = read_src(buffer, up_left < bufsz ? up_left : bufsz)) <= 0 )
+	       return -1;
+	 continue;
+      }
+
+      if ( (seq = (long long) get_be(h + 8, 8)) != up_offset )
+      {
+	 fprintf(stderr, "upstream: gap of %lld bytes\n", seq - up_offset);
+	 up_offset = seq;
+      }
+   }
+
+   return up_left < bufsz ? up_left : bufsz;
+}
+
+/* the source has ended (or failed); returns 0
+ */
+
+void flow(long long limit);
+
+int src_lost(char *what)
+{
+   int fired = wd_fired;
+
+   /* the end of one of the playlist's sources: on to the next
+    */
+
+   if ( playlist && ! fired && ! stalled && errno == 0 && pl_advance() == 0 )
+      return 0;
+
+   wd_fired = 0;
+   if ( fired )
+      fprintf(stderr, "watchdog: no data from the source for %ds\n", watchdog);
+
+   if ( sb_src != -1 )
+   {
+      failover(fired ? "stalled" : what);
+      return 0;
+   }
+
+   /* a relay does not die with its upstream server: close the connection;
+    * open_src() reconnects on the next pass through the main loop
+    */
+
+   if ( upstream )
+   {
+      fprintf(stderr, "upstream lost: %s\n", upstream);
+      close_src();
+      return 0;
+   }
+
+   /* stalled: open_src() starts it again on the next pass through the main
+    * loop
+    */
+
+   if ( fired )
+   {
+      close_src();
+      return 0;
+   }
+
+   /* with flow control, nothing is lost: the clients have all of the stream
+    * before the server exits
+    */
+
+   int e = errno;
+
+   if ( window && ! e )
+      flow(0);
+
+   die(what, e);
+   return 0;
+}
+
+/* ************************************************************************
+ */
+
+/* zerocopy completions: for each notification on the error queue, mark the
+ * sends in its range as complete
+ */
+
+void zc_reap(struct client *c)
+{
+   char control[128];
+   struct msghdr msg;
+   struct cmsghdr *cm;
+   unsigned id;
+
+   for (;;)
+   {
+      bzero(&msg, sizeof(msg));
+      msg.msg_control    = control;
+      msg.msg_controllen = sizeof(control);
+
+      if ( recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1 )
+	 return;
+
+      for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+      {
+	 struct sock_extended_err *ee = (struct sock_extended_err *) CMSG_DATA(cm);
+
+	 if ( ! ( ( cm->cmsg_level == SOL_IP   && cm->cmsg_type == IP_RECVERR   )
+	       || ( cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR ) ) )
+	    continue;
+
+	 if ( ee->ee_errno || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY )
+	    continue;
+
+	 for (id = ee->ee_info; id != ee->ee_data + 1; id += 1)
+	 {
+	    int q = id % ZCQUEUE;
+
+	    if ( c->zc_chunk[q] == -1 )
+	       continue;
+
+	    if ( ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+	    {
+	       c->zc_bytes  -= c->zc_len[q];
+	       c->zc_copied += c->zc_len[q];
+	    }
+
+	    ring[c->zc_chunk[q]].zc -= 1;
+	    c->zc_chunk[q] = -1;
+	 }
+      }
+   }
+}
+
+/* forget a client's outstanding zerocopy sends (it's going away)
+ */
+
+void zc_forget(struct client *c)
+{
+   struct linger abort = { 1, 0 };
+   int q, n = 0;
+
+   for (q = 0; q < ZCQUEUE; q += 1)
+      if ( c->zc_chunk[q] != -1 )
+      {
+	 ring[c->zc_chunk[q]].zc -= 1;
+	 c->zc_chunk[q] = -1;
+	 n += 1;
+      }
+
+   /* the kernel may still be sending from memory which is about to be
+    * reused; reset the connection, rather than send garbage
+    */
+
+   if ( n )
+      setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+}
+
+void drop_client(int i)
+{
+   struct client *c = &clients[i];
+
+   fprintf(stderr, "drop: %d/%d --> %d\n", i, cnt, cnt-1);
+   if ( c->zc )
+   {
+      zc_reap(c);
+      zc_forget(c);
+      fprintf(stderr, "drop: %d: zerocopy %lld, copied %lld (zerocopy fallback %lld)\n",
+	 i, c->zc_bytes, c->cp_bytes + c->zc_copied, c->zc_copied);
+   }
+   close(c->fd);
+   if ( c->filter )
+      filter_drop(c->filter);
+
+   zc_bytes  += c->zc_bytes;
+   zc_copied += c->zc_copied;
+   cp_bytes  += c->cp_bytes;
+
+   int j;
+   for ( j=i+1; j<cnt; j+=1 )
+      clients[j-1] = clients[j];
+
+   clients[--cnt].fd = 0;
+}
+
+/* wait (at most ZCWAIT ms) for the zerocopy sends from chunk <k> to complete;
+ * clients which still hold it after that are stalled, and are dropped
+ */
+
+void zc_wait(int k)
+{
+   struct pollfd pfd[MAXCLIENT];
+   int waited = 0, n, i;
+
+   while ( ring[k].zc && waited < ZCWAIT )
+   {
+      for (n = i = 0; i < cnt; i += 1)
+	 if ( clients[i].zc )
+	    pfd[n++] = (struct pollfd) { clients[i].fd, 0, 0 }; // POLLERR only
+
+      if ( poll(pfd, n, 10) == -1 && errno != EINTR )
+	 die("poll", errno);
+      waited += 10;
+
+      for (i = 0; i < cnt; i += 1)
+	 if ( clients[i].zc )
+	    zc_reap(&clients[i]);
+   }
+
+   for (i = 0; ring[k].zc && i < cnt; )
+   {
+      int q, holds = 0;
+
+      for (q = 0; q < ZCQUEUE; q += 1)
+	 holds |= clients[i].zc_chunk[q] == k;
+
+      if ( holds )
+	 drop_client(i);
+      else
+	 i += 1;
+   }
+
+   assert(ring[k].zc == 0);
+}
+
+/* send <len> bytes of chunk <k> to client <c>; returns the number of bytes
+ * sent or -1
+ */
+
+int send_client(struct client *c, int k, char *data, int len)
+{
+   int nw, q;
+
+   if ( ! c->zc )
+   {
+      if ( (nw = write(c->fd, data, len)) > 0 )
+	 c->cp_bytes += nw;
+      return nw;
+   }
+
+   /* the send numbers wrap (modulo ZCQUEUE): wait for the slot to be free
+    */
+
+   q = c->zc_next % ZCQUEUE;
+   while ( c->zc_chunk[q] != -1 )
+   {
+      struct pollfd pfd = { c->fd, 0, 0 };
+      int r;
+
+      while ( (r = poll(&pfd, 1, ZCWAIT)) == -1 && errno == EINTR ) // (the timers)
+	 ;
+      if ( r <= 0 )
+      {
+	 errno = ETIMEDOUT;
+	 return -1;
+      }
+      zc_reap(c);
+   }
+
+   /* ENOBUFS: the socket's notification memory (optmem) is exhausted; this
+    * send is copied
+    */
+
+   if ( (nw = send(c->fd, data, len, MSG_ZEROCOPY)) == -1 && errno == ENOBUFS )
+   {
+      if ( (nw = write(c->fd, data, len)) > 0 )
+	 c->cp_bytes += nw;
+      return nw;
+   }
+
+   if ( nw >= 0 )
+   {
+      c->zc_chunk[q] = k;
+      c->zc_len[q]   = nw;
+      c->zc_bytes   += nw;
+      c->zc_next    += 1;
+      ring[k].zc    += 1;
+   }
+
+   return nw;
+}
+
+/* ************************************************************************
+ * the single-client fast path: splice() from the source to the client
+ *
+ * a pipe source (a command) is spliced straight to the client's socket; other
+ * sources (an upstream socket) go through sp_pipe, since splice() needs a
+ * pipe at one end or the other
+ */
+
+/* spliced data never reaches the ring, so the history is lost: the stream
+ * offset advances, but the ring is emptied
+ */
+
+static int sp_on;            // is the fast path in use?
+static int sp_never;         // the source does not support splice()
+static int sp_pipe[2];       // for sources which are not pipes
+static long long sp_bytes;   // bytes spliced
+
+int fast_path()
+{
+   int fast = cnt == 1 && ! clients[0].hello && ! clients[0].filter && ! clients[0].framed && ! comp_users() && ! mcast_fd && ! record && ! history && ! window && ! dist && ! sp_never && next_src == -1 && sb_src == -1
+	      && ! pace && ! ( align && offset == src_start );
+
+   if ( fast != sp_on )
+      fprintf(stderr, "fast path (splice): %s\n", fast ? "on" : "off");
+
+   return sp_on = fast;
+}
+
+void spliced(int n)
+{
+   sp_bytes += n;
+   if ( ring[head].len ) // (only after fan-out)
+      for (i = 0; i < nchunk; i += 1)
+	 ring[i].len = 0;
+
+   offset += n;
+   clients[0].off = offset;
+}
+
+void splice_buf()
+{
+   struct stat sb;
+   int in, n, nw;
+
+   assert(src != -1);
+
+   if ( ring == NULL )
+      alloc_ring();
+
+   if ( fstat(in = src, &sb) == -1 )
+      die("stat", errno);
+
+   if ( S_ISFIFO(sb.st_mode) )
+   {
+      /* the source is a pipe: straight to the client; other than EOF, an
+       * error here is the client's
+       */
+
+      n = 0;
+      while ( ! ( in == STDIN_FILENO && wait_for(in) ) && cnt )
+	 if ( (n = splice(in, NULL, clients[0].fd, NULL, bufsz, SPLICE_F_MOVE | SPLICE_F_MORE)) >= 0 ||
+	      ( errno != EINTR && ( errno != EAGAIN || wait_for(in) ) ) )
+	    break;
+
+      if ( wd_fired )
+	 src_lost("stalled");
+      else if ( n <= 0 && ( reopen || ! cnt ) )
+	 return; // (restarting, or the client went while the source was quiet)
+      else if ( n == 0 )
+	 src_lost(( errno = 0, "end of source" ));
+      else if ( n < 0 )
+	 drop_client(0);
+      else
+	 spliced(n);
+
+      return;
+   }
+
+   if ( ! sp_pipe[0] && pipe2(sp_pipe, O_CLOEXEC) == -1 )
+      die("pipe2", errno);
+
+   /* an upstream (framed) source: headers are read, payloads spliced
+    */
+
+   if ( (n = upstream ? up_frame() : bufsz) <= 0 )
+   {
+      src_lost("splice");
+      return;
+   }
+
+   do n = splice(in, src_map ? &src_pos : NULL, sp_pipe[1], NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+   while ( n == -1 && ( errno == EINTR || ( errno == EAGAIN && ! wait_for(in) && cnt ) ) );
+
+   if ( wd_fired || ( n <= 0 && ( reopen || ! cnt ) ) )
+   {
+      if ( wd_fired )
+	 src_lost("stalled");
+      return;
+   }
+
+   if ( n == -1 && errno == EINVAL )
+   {
+      fprintf(stderr, "fast path (splice): not supported by the source\n");
+      sp_never = 1;
+      return;
+   }
+
+   if ( n <= 0 )
+   {
+      src_lost(n ? "splice" : ( errno = 0, "end of source" ));
+      return;
+   }
+
+   spliced(n);
+   if ( upstream )
+   {
+      up_offset += n;
+      up_left   -= n;
+   }
+
+   for (; n; n -= nw)
+      if ( (nw = splice(sp_pipe[0], NULL, clients[0].fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0 )
+      {
+	 if ( nw == -1 && errno == EINTR )
+	 {
+	    nw = 0;
+	    continue;
+	 }
+
+	 /* the client has gone; discard the rest of the data in the pipe
+	  */
+
+	 drop_client(0);
+	 while ( n > 0 && (nw = read(sp_pipe[0], ring[0].data, n < bufsz ? n : bufsz)) > 0 )
+	    n -= nw;
+	 return;
+      }
+}
+
+/* ************************************************************************
+ */
+
+/* find the chunk which holds stream offset <off> (usually the newest); -1 if
+ * there is none
+ */
+
+int find_chunk(long long off)
+{
+   int k, n;
+
+   for (k = head, n = 0; n < nchunk; k = ( k + nchunk - 1 ) % nchunk, n += 1)
+      if ( ring[k].len && ring[k].off <= off && off < ring[k].off + ring[k].len )
+	 return k;
+
+   return -1;
+}
+
+/* send client <c> everything from c->off to the end of the stream (usually
+ * just the newest chunk, but more for a client resuming from the history);
+ * returns 0, or -1 on failure
+ */
+
+int send_from(struct client *c)
+{
+   int k, skip, nw, len;
+
+   while ( c->off < offset )
+   {
+      if ( (k = find_chunk(c->off)) == -1 )
+      {
+	 c->off = oldest(); // overtaken, can only happen after the fast path
+	 c->hdr_left = c->frame_left = 0;
+	 continue;
+      }
+
+      skip = (int) ( c->off - ring[k].off );
+      len  = ring[k].len - skip;
+
+      /* framed: a frame is the rest of a chunk; with flow control (-F), the
+       * socket is non-blocking, and a send may stop part way through a
+       * frame (or its header), to carry on from there later
+       */
+
+      if ( c->framed && ! c->frame_left )
+      {
+	 mk_frame(c->hdr, len, 'D', c->off, ring[k].ts);
+	 c->hdr_left   = FRAMEHDR;
+	 c->frame_left = len;
+      }
+
+      for (; c->hdr_left; c->hdr_left -= nw)
+	 if ( (nw = send(c->fd, c->hdr + FRAMEHDR - c->hdr_left, c->hdr_left, MSG_MORE)) < 0 )
+	 {
+	    nw = 0;
+	    if ( errno == EAGAIN )
+	       return 0;
+	    if ( errno != EINTR )
+	       return -1;
+	 }
+
+      if ( c->framed && c->frame_left < len )
+	 len = c->frame_left;
+
+      for (; len; len -= nw, c->off += nw)
+      {
+	 if ( (nw = send_client(c, k, ring[k].data + skip, len)) < 0 )
+	 {
+	    nw = 0;
+	    if ( errno == EAGAIN )
+	       return 0;
+	    if ( errno != EINTR )
+	       return -1;
+	 }
+	 skip += nw;
+	 if ( c->framed )
+	    c->frame_left -= nw;
+      }
+   }
+
+   return 0;
+}
+
+void write_buf()
+{
+   int i = 0;
+
+   while ( i < cnt )
+   {
+      if ( clients[i].hello || clients[i].filter || send_from(&clients[i]) == 0 )
+      {
+	 // successful write (or not yet admitted): move on to next client
+	 i += 1;
+	 continue;
+      }
+
+      // unsuccessful write: close this client
+      drop_client(i);
+   }
+}
+
+/* ************************************************************************
+ * distribution (-D): rather than every client having the whole stream, each
+ * record (line) goes to just one client, so a pool of workers shares the
+ * work; a record split between chunks is carried over to the next one;
+ * each client's records are gathered, and sent with one writev() per chunk
+ * (or per DISTIOV records), in raw mode
+ */
+
+static char *dist_carry;     // the start of a record, from the last chunk ...
+static size_t dist_len, dist_cap; // ... its length, and the space for it
+static int   dist_next;      // rr: the next client
+static struct dist_q { struct iovec v[DISTIOV]; int n; long long queued; } *dist_q;
+
+/* FNV-1a, of field <dist_field> of the record (or all of it)
+ */
+
+unsigned dist_hash(char *p, char *end)
+{
+   unsigned h = 2166136261u;
+   int f;
+
+   for (f = 1; f < dist_field && p < end; f += 1)
+   {
+      while ( p < end && *p != ' ' && *p != '\t' )
+	 p += 1;
+      while ( p < end && ( *p == ' ' || *p == '\t' ) )
+	 p += 1;
+   }
+   for (; p < end && *p != '\n' && ( ! dist_field || ( *p != ' ' && *p != '\t' ) ); p += 1)
+      h = ( h ^ (unsigned char) *p ) * 16777619u;
+
+   return h;
+}
+
+/* send client <c> the records in <v>[<n>] (which are left as they are, as
+ * the filters share them); returns -1 if it has failed
+ */
+
+int send_iov(struct client *c, struct iovec *v, int n)
+{
+   ssize_t nw;
+   size_t left;
+   char *p;
+
+   while ( n )
+   {
+      if ( (nw = writev(c->fd, v, n < MAXIOV ? n : MAXIOV)) < 0 )
+      {
+	 if ( errno == EINTR )
+	    continue;
+	 return -1;
+      }
+      c->cp_bytes += nw;
+      for (; n && (size_t) nw >= v->iov_len; n -= 1, v += 1)
+	 nw -= v->iov_len;
+      if ( ! n || ! nw )
+	 continue;
+
+      /* the rest of a record, part sent
+       */
+
+      for (p = (char *) v->iov_base + nw, left = v->iov_len - nw; left; p += nw, left -= nw)
+	 if ( (nw = write(c->fd, p, left)) < 0 )
+	 {
+	    if ( errno != EINTR )
+	       return -1;
+	    nw = 0;
+	 }
+	 else
+	    c->cp_bytes += nw;
+      n -= 1;
+      v += 1;
+   }
+
+   return 0;
+}
+
+/* send client <k> its queued records; returns -1 if it has failed
+ */
+
+int dist_flush(int k)
+{
+   int n = dist_q[k].n;
+
+   dist_q[k].n = 0;
+   return send_iov(&clients[k], dist_q[k].v, n);
+}
+
+void write_dist()
+{
+   char *p = ring[head].data, *end = p + ring[head].len, *eol, *last;
+   int k, n, to, failed[MAXCLIENT], nf = 0;
+
+   if ( ! dist_q && ! (dist_q = calloc(MAXCLIENT, sizeof(*dist_q))) )
+      die("calloc", errno);
+
+   /* the start of a record from the last chunk: the rest of it is added
+    * (and anything after it, for simplicity)
+    */
+
+   if ( dist_len )
+   {
+      if ( dist_len + ring[head].len > dist_cap && ! (dist_carry = realloc(dist_carry, dist_cap = dist_len + ring[head].len)) )
+	 die("realloc", errno);
+      memcpy(dist_carry + dist_len, p, ring[head].len);
+      p   = dist_carry;
+      end = p + ( dist_len += ring[head].len );
+   }
+
+   for (k = n = 0; k < cnt; k += 1)
+      if ( ! clients[k].hello )
+      {
+	 n += 1;
+	 if ( dist == DIST_LEAST && ioctl(clients[k].fd, TIOCOUTQ, &to) == 0 )
+	    dist_q[k].queued = to;
+      }
+
+   /* no clients (or none yet past their hellos): keep the records, up to a
+    * point
+    */
+
+   last = end;
+   while ( last > p && last[-1] != '\n' )
+      last -= 1;
+
+   if ( ! n )
+      last = p;
+
+   for (; p < last; p = eol)
+   {
+      eol = memchr(p, '\n', last - p) + 1;
+
+      if ( dist == DIST_HASH )
+	 for (to = -1, n = dist_hash(p, eol) % n, k = 0; to == -1; k += 1)
+	    to = ! clients[k].hello && n-- == 0 ? k : -1;
+      else if ( dist == DIST_LEAST )
+	 for (to = -1, k = 0; k < cnt; k += 1)
+	    to = ! clients[k].hello && ( to == -1 || dist_q[k].queued < dist_q[to].queued ) ? k : to;
+      else
+	 for (to = dist_next % cnt; clients[to].hello; to = ( to + 1 ) % cnt)
+	    ;
+      dist_next = to + 1;
+
+      /* queue it (merged with the one before, if it is the same client's)
+       */
+
+      struct dist_q *q = &dist_q[to];
+      if ( q->n && (char *) q->v[q->n - 1].iov_base + q->v[q->n - 1].iov_len == p )
+	 q->v[q->n - 1].iov_len += eol - p;
+      else
+      {
+	 if ( q->n == DISTIOV && dist_flush(to) == -1 )
+	    failed[nf++] = to;
+	 q->v[q->n++] = (struct iovec) { p, eol - p };
+      }
+      q->queued += eol - p;
+      n = cnt;
+      if ( dist == DIST_HASH )
+	 for (k = n = 0; k < cnt; k += 1)
+	    n += ! clients[k].hello;
+   }
+
+   for (k = 0; k < cnt; k += 1)
+      if ( dist_q[k].n && dist_flush(k) == -1 )
+	 failed[nf++] = k;
+
+   /* what is left: the start of the next record
+    */
+
+   if ( end - last > DISTMAX )
+   {
+      fprintf(stderr, "distribution: no clients, %lld bytes discarded\n", (long long) ( end - last ));
+      last = end;
+   }
+   if ( end - last > (long) dist_cap && ! (dist_carry = realloc(dist_carry, dist_cap = end - last)) )
+      die("realloc", errno);
+   memmove(dist_carry, last, dist_len = end - last);
+
+   /* drop the clients which failed (from the last, as dropping shifts the
+    * others down)
+    */
+
+   while ( nf )
+   {
+      for (k = n = 0; n < nf; n += 1)
+	 if ( failed[n] > failed[k] )
+	    k = n;
+      to = failed[k];
+      failed[k] = failed[--nf];
+      for (n = 0; n < nf; n += 1)
+	 if ( failed[n] == to )
+	    failed[n--] = failed[--nf];
+      drop_client(to);
+   }
+}
+
+/* ************************************************************************
+ * filters (-e): a client which sends a filter in its hello has just the
+ * records (lines) which match it; each distinct filter is evaluated once
+ * per chunk, with memmem() (which is vectorised) to find the candidates,
+ * rather than record by record, and the records which match are sent to
+ * each of its clients with writev()
+ */
+
+static struct filter
+{
+   char     *spec;           // as sent by the client (to share it)
+   int       kind;           // FILT_PREFIX, FILT_FIXED or FILT_REGEX
+   char     *text;           // prefix: "\n<text>"; fixed: "<text>"
+   int       len;
+   regex_t   re;
+   int       users;          // clients
+   struct iovec *v;          // this chunk's records which match
+   int       nv, cap;
+} filters[MAXFILTER];
+
+static int   nfilter;        // filters in use
+static char *filt_carry;     // the start of a record, from the last chunk ...
+static size_t filt_len, filt_cap; // ... its length, and the space for it
+static int   filt_skip;      // skip to the start of the next record
+
+/* add a client with filter <spec> (%-escaped); returns the filter's number
+ * (from 1), or -1
+ */
+
+int filter_add(char *spec)
+{
+   struct filter *f;
+   char *p, *q, *t;
+   int k, free_k = -1;
+
+   for (k = 0; k < MAXFILTER; k += 1)
+      if ( filters[k].users && ! strcmp(filters[k].spec, spec) )
+      {
+	 filters[k].users += 1;
+	 return k + 1;
+      }
+      else if ( ! filters[k].users && free_k == -1 )
+	 free_k = k;
+
+   if ( free_k == -1 )
+   {
+      fprintf(stderr, "filter: MAXFILTER (%d) exceeded\n", MAXFILTER);
+      return -1;
+   }
+
+   f = &filters[free_k];
+   bzero(f, sizeof(*f));
+   if ( ! (f->spec = strdup(spec)) || ! (f->text = malloc(strlen(spec) + 2)) )
+      die("malloc", errno);
+
+   /* unescape it (after a "\n", for a prefix)
+    */
+
+   p = spec;
+   if ( ! strncmp(p, "prefix:", 7) )
+      f->kind = FILT_PREFIX, p += 7;
+   else if ( ! strncmp(p, "regex:", 6) )
+      f->kind = FILT_REGEX, p += 6;
+   else
+      f->kind = FILT_FIXED, p += strncmp(p, "fixed:", 6) ? 0 : 6;
+
+   t = q = f->text;
+   if ( f->kind == FILT_PREFIX )
+      *q++ = '\n';
+   for (; *p; q += 1)
+      if ( *p == '%' && p[1] && p[2] )
+      {
+	 char hex[3] = { p[1], p[2], 0 };
+	 *q = strtol(hex, NULL, 16);
+	 p += 3;
+      }
+      else
+	 *q = *p++;
+   *q = 0;
+   f->len = q - t;
+
+   if ( memchr(t + ( f->kind == FILT_PREFIX ), '\n', f->len - ( f->kind == FILT_PREFIX )) || strlen(t) != (size_t) f->len )
+   {
+      fprintf(stderr, "filter: %s: a newline or NUL\n", spec);
+      free(f->spec), free(f->text);
+      return -1;
+   }
+
+   /* REG_NEWLINE: a match is within a line (a record), and "^" and "$" are
+    * its start and end
+    */
+
+   if ( f->kind == FILT_REGEX && (k = regcomp(&f->re, t, REG_EXTENDED | REG_NEWLINE)) )
+   {
+      char err[MAXLINE];
+
+      regerror(k, &f->re, err, sizeof(err));
+      fprintf(stderr, "filter: %s: %s\n", spec, err);
+      free(f->spec), free(f->text);
+      return -1;
+   }
+
+   fprintf(stderr, "filter: %s (%d)\n", spec, free_k + 1);
+   if ( ! nfilter++ ) // (no record has been carried over: skip the rest of this one, if any)
+   {
+      filt_len  = 0;
+      filt_skip = ring && ring[head].len && ring[head].data[ring[head].len - 1] != '\n';
+   }
+   f->users = 1;
+   return free_k + 1;
+}
+
+void filter_drop(int k)
+{
+   struct filter *f = &filters[k - 1];
+
+   if ( --f->users )
+      return;
+
+   if ( f->kind == FILT_REGEX )
+      regfree(&f->re);
+   free(f->spec);
+   free(f->text);
+   free(f->v);
+   f->v = 0;
+   nfilter -= 1;
+}
+
+/* add the record <p> to <eol> to filter <f>'s matches
+ */
+
+void filter_span(struct filter *f, char *p, char *eol)
+{
+   if ( f->nv && (char *) f->v[f->nv - 1].iov_base + f->v[f->nv - 1].iov_len == p )
+   {
+      f->v[f->nv - 1].iov_len += eol - p;
+      return;
+   }
+
+   if ( f->nv == f->cap && ! (f->v = realloc(f->v, ( f->cap = f->cap ? 2 * f->cap : 256 ) * sizeof(*f->v))) )
+      die("realloc", errno);
+   f->v[f->nv++] = (struct iovec) { p, eol - p };
+}
+
+/* match filter <f> against the records from <p> to <end> (which are whole)
+ */
+
+void filter_run(struct filter *f, char *p, char *end)
+{
+   char *hit, *bol, *eol;
+   regmatch_t m;
+
+   switch ( f->kind )
+   {
+      case FILT_PREFIX:
+	 for (; p < end; p = eol)
+	 {
+	    if ( end - p < f->len - 1 || memcmp(p, f->text + 1, f->len - 1) )
+	    {
+	       if ( ! (hit = memmem(p, end - p, f->text, f->len)) || hit + 1 == end )
+		  break;
+	       p = hit + 1;
+	    }
+	    eol = (char *) memchr(p, '\n', end - p) + 1;
+	    filter_span(f, p, eol);
+	 }
+	 break;
+
+      case FILT_FIXED:
+	 for (; p < end && (hit = memmem(p, end - p, f->text, f->len)); p = eol)
+	 {
+	    bol = hit > p ? memrchr(p, '\n', hit - p) : 0;
+	    eol = (char *) memchr(hit, '\n', end - hit) + 1;
+	    filter_span(f, bol ? bol + 1 : p, eol);
+	 }
+	 break;
+
+      case FILT_REGEX: // (one regexec() finds the next record which matches)
+	 for (; p < end; p = eol)
+	 {
+	    m.rm_so = 0;
+	    m.rm_eo = end - p;
+	    if ( regexec(&f->re, p, 1, &m, REG_STARTEND) )
+	       break;
+	    hit = p + m.rm_so;
+	    bol = hit > p ? memrchr(p, '\n', hit - p) : 0;
+	    eol = (char *) memchr(hit, '\n', end - hit);
+	    eol = eol ? eol + 1 : end;
+	    filter_span(f, bol ? bol + 1 : p, eol);
+	 }
+	 break;
+   }
+}
+
+void write_filtered()
+{
+   char *p = ring[head].data, *end = p + ring[head].len, *last, *nl;
+   int k, f, failed[MAXCLIENT], nf = 0;
+
+   for (f = 0; f < MAXFILTER; f += 1)
+      filters[f].nv = 0;
+
+   /* the record carried over from the last chunk: complete it (unless it
+    * is too long)
+    */
+
+   nl = memchr(p, '\n', end - p);
+   last = nl ? nl + 1 : end;
+   if ( ! filt_skip )
+   {
+      if ( filt_len + ( last - p ) > MAXRECORD )
+      {
+	 fprintf(stderr, "filter: record of more than %d bytes dropped\n", MAXRECORD);
+	 filt_skip = 1;
+	 filt_len  = 0;
+      }
+      else if ( filt_len )
+      {
+	 if ( filt_len + ( last - p ) > filt_cap && ! (filt_carry = realloc(filt_carry, filt_cap = filt_len + ( last - p ))) )
+	    die("realloc", errno);
+	 memcpy(filt_carry + filt_len, p, last - p);
+	 filt_len += last - p;
+	 p = last;
+      }
+   }
+   if ( filt_skip && nl )
+   {
+      filt_skip = 0;
+      p = last;
+   }
+   else if ( filt_skip )
+      return;
+
+   if ( filt_len && nl )
+      for (f = 0; f < MAXFILTER; f += 1)
+	 if ( filters[f].users )
+	    filter_run(&filters[f], filt_carry, filt_carry + filt_len);
+
+   /* the whole records in this chunk
+    */
+
+   for (last = end; last > p && last[-1] != '\n'; last -= 1)
+      ;
+   for (f = 0; f < MAXFILTER; f += 1)
+      if ( filters[f].users )
+	 filter_run(&filters[f], p, last);
+
+   for (k = 0; k < cnt; k += 1)
+      if ( clients[k].filter && ! clients[k].hello && filters[clients[k].filter - 1].nv )
+	 if ( send_iov(&clients[k], filters[clients[k].filter - 1].v, filters[clients[k].filter - 1].nv) == -1 )
+	    failed[nf++] = k;
+
+   /* what is left: the start of the next record (or more of it)
+    */
+
+   if ( nl )
+      filt_len = 0;
+   if ( filt_len + ( end - last ) > filt_cap && ! (filt_carry = realloc(filt_carry, filt_cap = filt_len + ( end - last ))) )
+      die("realloc", errno);
+   memcpy(filt_carry + filt_len, last, end - last);
+   filt_len += end - last;
+
+   while ( nf )
+      drop_client(failed[--nf]); // (from the last)
+}
+
+/* ************************************************************************
+ * compression (-Z): a client which asks for it in its hello (and has a raw
+ * stream) is handed over to the compression thread; the main thread just
+ * copies each chunk into the thread's queue, and the thread compresses it,
+ * once for each codec in use, as a frame of its own (so a client can start
+ * with any chunk), and sends it to each of its clients; so neither the
+ * compression nor a slow compressed client holds up the other clients; if
+ * the queue fills (the thread is behind), the compressed clients are dropped
+ */
+
+#ifdef WITH_COMPRESS
+
+static pthread_t comp_thread;
+static int   comp_running;   // the thread has been started
+static pthread_mutex_t comp_lock = PTHREAD_MUTEX_INITIALIZER; // for all of the below
+static pthread_cond_t  comp_cond = PTHREAD_COND_INITIALIZER;
+static struct { char *data; int len, cap; } comp_q[COMPQUEUE]; // the queue ...
+static int   comp_head, comp_tail; // ... in at the head, out at the tail
+static int   comp_end;       // the end of the stream
+static struct comp_client { int fd, codec, lost, dead; } comp_clients[MAXCLIENT];
+static int   comp_cnt;       // (changed only by the main thread, so that demand() is stable)
+static long long comp_in, comp_out; // bytes, before and after
+static int   comp_errno;     // the thread's failure (the main thread dies of it)
+
+int comp_codec(char *name)
+{
+#ifdef WITH_ZSTD
+   if ( ! strcmp(name, "zstd") )
+      return COMP_ZSTD;
+#endif
+#ifdef WITH_LZ4
+   if ( ! strcmp(name, "lz4") )
+      return COMP_LZ4;
+#endif
+   return 0;
+}
+
+/* compress <len> bytes at <src> as a frame, into *<dst> (grown as
+ * necessary); returns its length, or -1 (with errno ENOMEM, if *<dst>
+ * could not be grown)
+ */
+
+int comp_frame(int codec, char **dst, size_t *cap, char *src, int len)
+{
+   size_t bound = 0, n = 0;
+   char *p;
+
+#ifdef WITH_ZSTD
+   if ( codec == COMP_ZSTD )
+      bound = ZSTD_compressBound(len);
+#endif
+#ifdef WITH_LZ4
+   if ( codec == COMP_LZ4 )
+      bound = LZ4F_compressFrameBound(len, NULL);
+#endif
+   if ( bound > *cap )
+   {
+      if ( ! (p = realloc(*dst, bound)) )
+	 return errno = ENOMEM, -1;
+      *dst = p;
+      *cap = bound;
+   }
+   errno = EPROTO;
+
+#ifdef WITH_ZSTD
+   if ( codec == COMP_ZSTD )
+   {
+      static ZSTD_CCtx *cctx;
+
+      if ( ! cctx && ! (cctx = ZSTD_createCCtx()) )
+	 return -1;
+      n = ZSTD_compressCCtx(cctx, *dst, *cap, src, len, ZSTD_CLEVEL_DEFAULT);
+      return ZSTD_isError(n) ? -1 : (int) n;
+   }
+#endif
+#ifdef WITH_LZ4
+   if ( codec == COMP_LZ4 )
+   {
+      n = LZ4F_compressFrame(*dst, *cap, src, len, NULL);
+      return LZ4F_isError(n) ? -1 : (int) n;
+   }
+#endif
+   return (int) n - 1;
+}
+
+/* send the clients their frames (<out>, <n> bytes, by codec), without
+ * blocking, so that one which is not reading does not hold up the others;
+ * those which cannot take all of it are waited for together, and dropped if
+ * they take longer than COMPSENDWAIT, or once the queue is half full (before
+ * write_comp() has to drop everyone, as behind)
+ */
+
+void comp_send(struct comp_client *cl, int nc, char **out, int *n)
+{
+   struct pollfd pfd[MAXCLIENT];
+   long long until = now_ms() + COMPSENDWAIT;
+   int left[MAXCLIENT], k, np, sent, queued;
+
+   for (k = 0; k < nc; k += 1)
+      left[k] = cl[k].lost ? 0 : n[cl[k].codec];
+
+   for (;;)
+   {
+      for (k = np = 0; k < nc; k += 1)
+      {
+	 while ( left[k] && (sent = send(cl[k].fd, out[cl[k].codec] + n[cl[k].codec] - left[k], left[k], MSG_NOSIGNAL | MSG_DONTWAIT)) > 0 )
+	    left[k] -= sent;
+	 if ( left[k] && errno != EAGAIN && errno != EINTR )
+	 {
+	    cl[k].lost = 1;
+	    left[k]    = 0;
+	 }
+	 if ( left[k] )
+	    pfd[np++] = (struct pollfd) { cl[k].fd, POLLOUT, 0 };
+      }
+      if ( ! np )
+	 return;
+
+      pthread_mutex_lock(&comp_lock);
+      queued = ( comp_head - comp_tail + COMPQUEUE ) % COMPQUEUE;
+      pthread_mutex_unlock(&comp_lock);
+      if ( now_ms() >= until || queued > COMPQUEUE / 2 )
+      {
+	 for (k = 0; k < nc; k += 1)
+	    if ( left[k] )
+	    {
+	       fprintf(stderr, "compress: %d: stalled, dropped\n", cl[k].fd);
+	       cl[k].lost = 1;
+	    }
+	 return;
+      }
+      poll(pfd, np, 10); // (and look at the queue again)
+   }
+}
+
+void *comp_main(void *arg)
+{
+   static struct comp_client cl[MAXCLIENT];
+   static char *out[3];
+   static size_t cap[3];
+   int n[3], k, j, nc, len, nomem;
+   long long sent;
+   char *data;
+
+   for (;;)
+   {
+      pthread_mutex_lock(&comp_lock);
+      while ( comp_head == comp_tail && ! comp_end )
+	 pthread_cond_wait(&comp_cond, &comp_lock);
+      if ( comp_head == comp_tail )
+      {
+	 pthread_mutex_unlock(&comp_lock);
+	 return 0;
+      }
+      data = comp_q[comp_tail].data;
+      len  = comp_q[comp_tail].len;
+      for (k = nc = 0; k < comp_cnt; k += 1)
+	 if ( ! comp_clients[k].dead )
+	    cl[nc++] = comp_clients[k];
+      pthread_mutex_unlock(&comp_lock);
+
+      /* compress the chunk (once for each codec), and send it
+       */
+
+      n[COMP_ZSTD] = n[COMP_LZ4] = -2;
+      for (k = nomem = sent = 0; k < nc; k += 1)
+      {
+	 if ( cl[k].lost )
+	    continue;
+	 if ( n[cl[k].codec] == -2 )
+	 {
+	    if ( (n[cl[k].codec] = comp_frame(cl[k].codec, &out[cl[k].codec], &cap[cl[k].codec], data, len)) > 0 )
+	       sent += n[cl[k].codec];
+	    else
+	       nomem |= errno == ENOMEM;
+	 }
+	 if ( n[cl[k].codec] < 0 )
+	    cl[k].lost = 1;
+      }
+      comp_send(cl, nc, out, n);
+
+      /* close the clients which failed (or which the main thread has given
+       * up on); the main thread removes them, and move on
+       */
+
+      pthread_mutex_lock(&comp_lock);
+      for (k = 0; k < comp_cnt; k += 1)
+      {
+	 if ( comp_clients[k].dead )
+	    continue;
+	 for (j = 0; j < nc && ( cl[j].fd != comp_clients[k].fd || ! cl[j].lost ); j += 1)
+	    ;
+	 if ( j < nc || comp_clients[k].lost )
+	 {
+	    fprintf(stderr, "compress: drop %d\n", comp_clients[k].fd);
+	    close(comp_clients[k].fd);
+	    comp_clients[k].dead = 1;
+	 }
+      }
+      if ( nomem )
+	 comp_errno = ENOMEM;
+      comp_in  += len;
+      comp_out += sent;
+      comp_tail = ( comp_tail + 1 ) % COMPQUEUE;
+      pthread_mutex_unlock(&comp_lock);
+   }
+}
+
+int comp_users()
+{
+   int n;
+
+   pthread_mutex_lock(&comp_lock);
+   n = comp_cnt;
+   pthread_mutex_unlock(&comp_lock);
+   return n;
+}
+
+void comp_add(struct client *c)
+{
+   if ( ! comp_running && (errno = pthread_create(&comp_thread, NULL, comp_main, NULL)) )
+      die("pthread_create", errno);
+   comp_running = 1;
+
+   pthread_mutex_lock(&comp_lock);
+   if ( comp_cnt == MAXCLIENT )
+      close(c->fd);
+   else
+      comp_clients[comp_cnt++] = (struct comp_client) { c->fd, c->codec, 0, 0 };
+   pthread_mutex_unlock(&comp_lock);
+}
+
+/* queue the current chunk for the compression thread
+ */
+
+void write_comp()
+{
+   int k, e, len = ring[head].len;
+   char *p;
+
+   pthread_mutex_lock(&comp_lock);
+   if ( (e = comp_errno) )
+   {
+      pthread_mutex_unlock(&comp_lock);
+      die("compress: realloc", e);
+   }
+
+   for (k = 0; k < comp_cnt; )
+      if ( comp_clients[k].dead )
+	 comp_clients[k] = comp_clients[--comp_cnt];
+      else
+	 k += 1;
+
+   if ( ! comp_cnt )
+      ;
+   else if ( ( comp_head + 1 ) % COMPQUEUE == comp_tail )
+   {
+      for (k = 0; k < comp_cnt; k += 1)
+	 if ( ! comp_clients[k].lost && ! comp_clients[k].dead )
+	 {
+	    fprintf(stderr, "compress: %d: behind, dropped\n", comp_clients[k].fd);
+	    comp_clients[k].lost = 1;
+	    shutdown(comp_clients[k].fd, SHUT_RDWR); // (so the thread, if it is waiting to send to it, gives up)
+	 }
+   }
+   else
+   {
+      if ( len > comp_q[comp_head].cap )
+      {
+	 if ( ! (p = realloc(comp_q[comp_head].data, len)) )
+	 {
+	    pthread_mutex_unlock(&comp_lock);
+	    die("realloc", ENOMEM);
+	 }
+	 comp_q[comp_head].data = p;
+	 comp_q[comp_head].cap  = len;
+      }
+      memcpy(comp_q[comp_head].data, buffer, len);
+      comp_q[comp_head].len = len;
+      comp_head = ( comp_head + 1 ) % COMPQUEUE;
+      pthread_cond_signal(&comp_cond);
+   }
+   pthread_mutex_unlock(&comp_lock);
+}
+
+/* at exit: at the end of the stream (<drain>), give the thread COMPDRAIN ms
+ * to send what is queued
+ */
+
+void comp_stop(int drain)
+{
+   struct timespec until;
+
+   if ( ! comp_running || ! drain )
+      return;
+
+   pthread_mutex_lock(&comp_lock);
+   comp_end = 1;
+   pthread_cond_signal(&comp_cond);
+   pthread_mutex_unlock(&comp_lock);
+
+   clock_gettime(CLOCK_REALTIME, &until);
+   until.tv_sec  += ( until.tv_nsec + COMPDRAIN * 1000000LL ) / 1000000000;
+   until.tv_nsec  = ( until.tv_nsec + COMPDRAIN * 1000000LL ) % 1000000000;
+   if ( pthread_timedjoin_np(comp_thread, NULL, &until) )
+      fprintf(stderr, "compress: not finished\n");
+}
+
+void comp_report()
+{
+   long long in, out;
+   int n;
+
+   if ( ! comp_running )
+      return;
+
+   pthread_mutex_lock(&comp_lock);
+   n   = comp_cnt;
+   in  = comp_in;
+   out = comp_out;
+   pthread_mutex_unlock(&comp_lock);
+   fprintf(stderr, "report: compressed clients %d, bytes in %lld, out %lld\n", n, in, out);
+}
+
+#else
+
+int  comp_codec(char *name)      { return 0; }
+int  comp_users()                { return 0; }
+void comp_add(struct client *c)  { }
+void write_comp()                { }
+void comp_stop(int drain)        { }
+void comp_report()               { }
+
+#endif
+
+/* ************************************************************************
+ * recording (-O): the main thread copies the stream into RECBLOCK blocks,
+ * and passes each on when it is full (or RECFLUSH ms old); the recorder's
+ * thread writes them, to segments which it opens (preallocated) as the
+ * main thread says; nothing is dropped: if RECQUEUE blocks are waiting,
+ * the main thread waits (so the source is held back)
+ */
+
+static pthread_t rec_thread;
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER; // for the queue
+static pthread_cond_t  rec_cond = PTHREAD_COND_INITIALIZER;
+static struct { char *data; int len, rotate; } rec_q[RECQUEUE]; // the queue (rotate: a new segment); rec_q[rec_head] is being filled ...
+static int   rec_head, rec_tail, rec_end; // ... and passed on at the head, written at the tail
+static char *rec_prefix;     // main thread: the segments' names ...
+static long long rec_size, rec_time; // ... when to start the next (bytes, ms) ...
+static long long rec_seg, rec_seg_start, rec_since; // ... bytes in this one, and when it (and the block) started
+static long long rec_bytes, rec_waits; // stats (rec_waits the main thread's ...
+static int   rec_segs, rec_failed;   // ... the others the thread's, under rec_lock)
+
+/* the recorder's thread: a segment's file is created, and space reserved
+ * for it; when it is done, it is cut to the length written
+ */
+
+int rec_open()
+{
+   static time_t last;
+   static int k;             // (the next suffix, for segments within the same second)
+   char when[32], *name = 0;
+   time_t t = time(NULL);
+   int fd;
+
+   if ( t != last )
+      k = 0;
+   last = t;
+   strftime(when, sizeof(when), "%Y%m%d-%H%M%S", localtime(&t));
+   for (;; k += 1)
+   {
+      name = print(name, k ? "%s-%s.%03d" : "%s-%s", rec_prefix, when, k);
+      if ( (fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) != -1 || errno != EEXIST )
+	 break;
+   }
+   k += 1;
+
+   if ( fd == -1 )
+      fprintf(stderr, "record: %s: %s\n", name, strerror(errno));
+   else
+   {
+      fprintf(stderr, "record: %s\n", name);
+      fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, rec_size ? rec_size : RECPREALLOC); // (just a hint)
+   }
+   free(name);
+   return fd;
+}
+
+void rec_close(int fd, long long len)
+{
+   if ( fd == -1 )
+      return;
+   if ( ftruncate(fd, len) == -1 || close(fd) == -1 )
+      fprintf(stderr, "record: close: %s\n", strerror(errno));
+}
+
+void *rec_main(void *arg)
+{
+   int fd = -1, failed = 0, len, n, rotate, opened, lost;
+   long long seg = 0, wrote;
+   char *p;
+
+   for (;;)
+   {
+      pthread_mutex_lock(&rec_lock);
+      while ( rec_tail == rec_head && ! rec_end )
+	 pthread_cond_wait(&rec_cond, &rec_lock);
+      if ( rec_tail == rec_head )
+      {
+	 pthread_mutex_unlock(&rec_lock);
+	 break;
+      }
+      p      = rec_q[rec_tail].data;
+      len    = rec_q[rec_tail].len;
+      rotate = rec_q[rec_tail].rotate;
+      pthread_mutex_unlock(&rec_lock);
+
+      opened = lost = wrote = 0;
+      if ( rotate || ( fd == -1 && ! failed ) )
+      {
+	 rec_close(fd, seg);
+	 failed = (fd = rec_open()) == -1;
+	 opened = ! failed;
+	 seg    = 0;
+      }
+
+      /* (after a failure, the stream is lost until the next segment)
+       */
+
+      for (; fd != -1 && len; p += n, len -= n, seg += n, wrote += n)
+	 if ( (n = write(fd, p, len)) == -1 )
+	 {
+	    if ( errno == EINTR )
+	       n = 0;
+	    else
+	    {
+	       fprintf(stderr, "record: write: %s (until the next segment)\n", strerror(errno));
+	       rec_close(fd, seg);
+	       fd     = -1;
+	       failed = 1;
+	       lost   = 1;
+	       break;
+	    }
+	 }
+
+      pthread_mutex_lock(&rec_lock);
+      rec_bytes  += wrote;
+      rec_segs   += opened;
+      rec_failed += lost;
+      rec_tail = ( rec_tail + 1 ) % RECQUEUE;
+      pthread_cond_signal(&rec_cond);
+      pthread_mutex_unlock(&rec_lock);
+   }
+
+   rec_close(fd, seg);
+   return 0;
+}
+
+/* the main thread
+ */
+
+void rec_block(int k)
+{
+   if ( ! rec_q[k].data && (errno = posix_memalign((void **) &rec_q[k].data, 4096, RECBLOCK)) )
+      die("posix_memalign", errno);
+   rec_q[k].len    = 0;
+   rec_q[k].rotate = 0;
+   rec_since       = now_ms();
+}
+
+void open_rec()
+{
+   enum { SIZE, TIME };
+   char *const tokens[] = { "size", "time", NULL };
+   char *opts = strchr(record, ','), *value, *end;
+
+   if ( opts )
+      *opts++ = 0;
+
+   while ( opts && *opts )
+      switch ( getsubopt(&opts, tokens, &value) )
+      {
+	 case SIZE:
+	    if ( ! value || (rec_size = strtoll(value, &end, 10)) <= 0 || ( *end && ( ! strchr("kMG", *end) || end[1] ) ) )
+	       die("-O: size", EINVAL);
+	    rec_size *= *end == 'k' ? 1000 : *end == 'M' ? 1000000 : *end == 'G' ? 1000000000 : 1;
+	    break;
+	 case TIME:
+	    if ( ! value || (rec_time = strtoll(value, &end, 10) * 1000) <= 0 || *end )
+	       die("-O: time", EINVAL);
+	    break;
+	 default:
+	    die("-O: unknown option", EINVAL);
+      }
+
+   if ( ! *record || rec_size < 0 || rec_time < 0 )
+      die("-O prefix[,size=bytes][,time=secs]", EINVAL);
+
+   rec_prefix    = record;
+   rec_seg_start = now_ms();
+   rec_block(rec_head);
+   if ( (errno = pthread_create(&rec_thread, NULL, rec_main, NULL)) )
+      die("pthread_create", errno);
+}
+
+/* pass the block being filled on to the recorder's thread (waiting, if
+ * its queue is full), and start the next
+ */
+
+void rec_pass()
+{
+   int next = ( rec_head + 1 ) % RECQUEUE;
+
+   pthread_mutex_lock(&rec_lock);
+   if ( next == rec_tail )
+   {
+      if ( ! rec_waits++ ) // (counted in the report, after the first)
+	 fprintf(stderr, "record: disk behind, holding the source\n");
+      while ( next == rec_tail )
+	 pthread_cond_wait(&rec_cond, &rec_lock);
+   }
+   rec_head = next;
+   pthread_cond_signal(&rec_cond);
+   pthread_mutex_unlock(&rec_lock);
+   rec_block(rec_head);
+}
+
+void write_rec()
+{
+   char *p = buffer;
+   int len = ring[head].len, n;
+   long long now = now_ms();
+
+   if ( ! record )
+      return;
+
+   while ( len )
+   {
+      if ( ( rec_size && rec_seg == rec_size ) || ( rec_time && rec_seg && now - rec_seg_start >= rec_time ) )
+      {
+	 if ( rec_q[rec_head].len )
+	    rec_pass();
+	 rec_q[rec_head].rotate = 1;
+	 rec_seg       = 0;
+	 rec_seg_start = now;
+      }
+
+      n = RECBLOCK - rec_q[rec_head].len;
+      n = len < n ? len : n;
+      n = rec_size && rec_size - rec_seg < n ? (int) ( rec_size - rec_seg ) : n;
+      memcpy(rec_q[rec_head].data + rec_q[rec_head].len, p, n);
+      rec_q[rec_head].len += n;
+      rec_seg += n;
+      p       += n;
+      len     -= n;
+      if ( rec_q[rec_head].len == RECBLOCK )
+	 rec_pass();
+   }
+
+   if ( rec_q[rec_head].len && now - rec_since >= RECFLUSH )
+      rec_pass();
+}
+
+/* at exit: whatever the reason, the recording is finished
+ */
+
+void rec_stop()
+{
+   if ( ! rec_prefix )
+      return;
+
+   if ( rec_q[rec_head].len )
+      rec_pass();
+   pthread_mutex_lock(&rec_lock);
+   rec_end = 1;
+   pthread_cond_signal(&rec_cond);
+   pthread_mutex_unlock(&rec_lock);
+   pthread_join(rec_thread, NULL);
+   rec_prefix = 0;
+}
+
+void rec_report()
+{
+   long long bytes;
+   int segs, failed;
+
+   pthread_mutex_lock(&rec_lock);
+   bytes  = rec_bytes;
+   segs   = rec_segs;
+   failed = rec_failed;
+   pthread_mutex_unlock(&rec_lock);
+
+   if ( segs || failed )
+      fprintf(stderr, "report: recorded %lld bytes, segments %d, disk waits %lld, write failures %d\n",
+	 bytes, segs, rec_waits, failed);
+}
+
+/* ************************************************************************
+ * flow control (-F): rather than read on regardless (and let a slow client
+ * hold up everyone, in a blocking send), the server sends to clients only
+ * what their sockets will take, and reads from the source only while the
+ * slowest client is within the window; faster clients run ahead, within
+ * the window, and the source is held back (not read) meanwhile
+ */
+
+long long slowest()
+{
+   long long off = offset;
+   int k;
+
+   for (k = 0; k < cnt; k += 1)
+      if ( ! clients[k].hello && clients[k].off < off )
+	 off = clients[k].off;
+
+   return off;
+}
+
+/* wait until the slowest client is at most <limit> bytes behind, sending to
+ * clients as they can take it
+ */
+
+void flow(long long limit)
+{
+   struct pollfd pfd[MAXCLIENT + 1];
+   int k, n;
+
+   while ( offset - slowest() > limit )
+   {
+      pfd[0] = (struct pollfd) { sig_fd, POLLIN, 0 };
+      for (k = 0, n = 1; k < cnt; k += 1)
+	 pfd[n++] = (struct pollfd) { clients[k].fd, clients[k].off < offset && ! clients[k].hello ? POLLOUT : 0, 0 };
+
+      if ( poll(pfd, n, -1) == -1 && errno != EINTR )
+	 die("poll", errno);
+      if ( pfd[0].revents )
+	 signals();
+
+      for (k = cnt; k--; )
+	 if ( pfd[k + 1].revents && send_from(&clients[k]) == -1 )
+	    drop_client(k);
+   }
+}
+
+/* ************************************************************************
+ * statistics (on exit, and on SIGUSR1)
+ */
+
+void report()
+{
+   long long zb = zc_bytes, zcp = zc_copied, cb = cp_bytes;
+   int i;
+
+   for (i = 0; i < cnt; i += 1)
+   {
+      zb  += clients[i].zc_bytes;
+      zcp += clients[i].zc_copied;
+      cb  += clients[i].cp_bytes;
+   }
+
+   fprintf(stderr, "report: clients %d, bytes sent %lld, zerocopy %lld, copied %lld (zerocopy fallback %lld), spliced %lld\n",
+      cnt, zb + zcp + cb + sp_bytes, zb, cb + zcp, zcp, sp_bytes);
+   if ( backup )
+      fprintf(stderr, "report: failovers %d, on %s\n", failovers, on_backup ? "backup" : "primary");
+   if ( watchdog )
+      fprintf(stderr, "report: stalls %d\n", stalls);
+   comp_report();
+   rec_report();
+}
+
+/* ************************************************************************
+ * multicast sink
+ *
+ * the stream is cut into datagrams of mc_size payload bytes (the tail of
+ * each buffer, a partial datagram, is held back until the next); all of the
+ * complete datagrams in a buffer go to the kernel in a single system call:
+ * one sendmsg() with UDP_SEGMENT (GSO) set if the kernel supports it,
+ * otherwise one sendmmsg(); the datagrams are described by iovecs which
+ * point into the buffer, so the payload is not copied
+ */
+
+static int    mc_size = 1316;   // payload bytes per datagram
+static int    mc_rtp;           // RTP packetization?
+static int    mc_pt   = 33;     // RTP payload type (MPEG-TS)
+static int    mc_gso;           // UDP_SEGMENT in use?
+static char  *mc_tail;          // partial datagram held back
+static int    mc_ntail;
+static unsigned short mc_seq;   // RTP sequence number
+static unsigned int   mc_ssrc;  // RTP synchronization source
+
+void open_mcast()
+{
+   enum { RTP, PT, TTL, IF, SIZE };
+   char *const tokens[] = { "rtp", "pt", "ttl", "if", "size", NULL };
+   char *opts = strchr(mcast, ','), *value;
+   int ttl = 1, ifindex = 0;
+   struct addrinfo *res;
+
+   if ( opts )
+      *opts++ = 0;
+
+   while ( opts && *opts )
+      switch ( getsubopt(&opts, tokens, &value) )
+      {
+	 case RTP:  mc_rtp  = 1;                                         break;
+	 case PT:   mc_pt   = value ? atoi(value) : mc_pt;               break;
+	 case TTL:  ttl     = value ? atoi(value) : ttl;                 break;
+	 case IF:   ifindex = value ? (int) if_nametoindex(value) : 0;  break;
+	 case SIZE: mc_size = value ? atoi(value) : mc_size;             break;
+	 default:   die("-m: unknown option", EINVAL);
+      }
+
+   if ( mc_size <= 0 || mc_size + RTPHDR > 65507 )
+      die("-m: size", EINVAL);
+
+   if ( ! ( res = mk_addrinfo(mcast, 0, SOCK_DGRAM) ) )
+      die("-m", EINVAL);
+
+   if ( (mcast_fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 )
+      die("socket (multicast)", errno);
+
+   if ( res->ai_family == AF_INET6 )
+   {
+      setsockopt(mcast_fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl));
+      if ( ifindex )
+	 setsockopt(mcast_fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex));
+   }
+   else
+   {
+      struct ip_mreqn mreq = { .imr_ifindex = ifindex };
+
+      setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+      if ( ifindex )
+	 setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq));
+   }
+
+   if ( connect(mcast_fd, res->ai_addr, res->ai_addrlen) )
+      die("connect (multicast)", errno);
+
+   freeaddrinfo(res);
+
+   /* GSO: the kernel cuts each send into datagrams of this size
+    */
+
+   int segsz = mc_size + ( mc_rtp ? RTPHDR : 0 );
+   mc_gso = setsockopt(mcast_fd, SOL_UDP, UDP_SEGMENT, &segsz, sizeof(segsz)) == 0;
+
+   if ( ! ( mc_tail = malloc(mc_size) ) )
+      die("malloc", errno);
+
+   mc_ssrc = (unsigned int) getpid() ^ (unsigned int) time(NULL);
+
+   fprintf(stderr, "multicast: %s (%d bytes%s%s)\n",
+      mcast, mc_size, mc_rtp ? ", rtp" : "", mc_gso ? ", gso" : "");
+}
+
+/* send up to MAXSEGMENT complete datagrams, taking the payload first from
+ * the held back tail and then from <data>; returns the number of bytes of
+ * <data> consumed
+ */
+
+int send_mcast(char *data, int len)
+{
+   static unsigned char  hdr[MAXSEGMENT][RTPHDR];
+   static struct iovec   iov[MAXSEGMENT * 3];
+   static struct mmsghdr msg[MAXSEGMENT];
+   struct timespec ts;
+   int nseg, niov = 0, used = 0, s;
+
+   nseg = (mc_ntail + len) / mc_size;
+   if ( nseg > MAXSEGMENT )
+      nseg = MAXSEGMENT;
+   if ( mc_gso && nseg > 65507 / ( mc_size + ( mc_rtp ? RTPHDR : 0 ) ) ) // (GSO's limit is on the whole)
+      nseg = 65507 / ( mc_size + ( mc_rtp ? RTPHDR : 0 ) );
+   if ( nseg == 0 )
+      return 0;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   unsigned int stamp = (unsigned int) (ts.tv_sec * 90000 + ts.tv_nsec / 11111);
+
+   for (s = 0; s < nseg; s += 1)
+   {
+      int need = mc_size;
+
+      msg[s].msg_hdr = (struct msghdr) { .msg_iov = iov + niov };
+
+      if ( mc_rtp )
+      {
+	 unsigned char *h = hdr[s];
+
+	 h[0]  = 0x80;
+	 h[1]  = mc_pt & 0x7f;
+	 h[2]  = mc_seq >> 8;   h[3]  = mc_seq;
+	 h[4]  = stamp >> 24;   h[5]  = stamp >> 16;   h[6]  = stamp >> 8;   h[7]  = stamp;
+	 h[8]  = mc_ssrc >> 24; h[9]  = mc_ssrc >> 16; h[10] = mc_ssrc >> 8; h[11] = mc_ssrc;
+	 mc_seq += 1;
+	 iov[niov++] = (struct iovec) { h, RTPHDR };
+      }
+
+      if ( s == 0 && mc_ntail )
+      {
+	 iov[niov++] = (struct iovec) { mc_tail, mc_ntail };
+	 need -= mc_ntail;
+      }
+
+      iov[niov++] = (struct iovec) { data + used, need };
+      used += need;
+      msg[s].msg_hdr.msg_iovlen = iov + niov - msg[s].msg_hdr.msg_iov;
+   }
+
+   mc_ntail = 0;
+
+   if ( mc_gso )
+   {
+      struct msghdr mh = { .msg_iov = iov, .msg_iovlen = niov };
+
+      if ( sendmsg(mcast_fd, &mh, 0) == -1 && ( errno == EIO || errno == EINVAL || errno == EMSGSIZE ) )
+      {
+	 /* the route (or device) cannot segment; fall back to sendmmsg()
+	  */
+	 int segsz = 0;
+	 setsockopt(mcast_fd, SOL_UDP, UDP_SEGMENT, &segsz, sizeof(segsz));
+	 fprintf(stderr, "multicast: GSO unavailable, using sendmmsg\n");
+	 mc_gso = 0;
+	 sendmmsg(mcast_fd, msg, nseg, 0);
+      }
+   }
+   else
+      for (s = 0; s < nseg; s += err > 0 ? err : nseg)
+	 if ( (err = sendmmsg(mcast_fd, msg + s, nseg - s, 0)) == -1 && errno != EINTR )
+	    break;
+
+   /* UDP is lossy anyway: errors such as ENOBUFS (or ECONNREFUSED, for
+    * a unicast destination) just drop the datagrams
+    */
+
+   return used;
+}
+
+void write_mcast()
+{
+   int off = 0;
+
+   if ( ! mcast_fd )
+      return;
+
+   int len = ring[head].len;
+
+   while ( (err = send_mcast(buffer + off, len - off)) )
+      off += err;
+
+   assert(mc_ntail + len - off < mc_size);
+   memcpy(mc_tail + mc_ntail, buffer + off, len - off);
+   mc_ntail += len - off;
+}
+
+/* ************************************************************************
+ */
+
+void usage(char *name)
+{
+   fprintf(stderr,"usage: %s shell-command [ arg ... ]    (server mode)\n",    name);
+   fprintf(stderr,"   or: %s -c shell-command [ arg ... ] (client mode)\n",    name);
+   fprintf(stderr,"   or: %s -c [ -o file ]               (client mode, built-in sink)\n", name);
+   fprintf(stderr,"   or: %s -c -a [ shell-command ... ]  (client mode, reconnecting)\n", name);
+   fprintf(stderr,"   or: %s -c -v [ shell-command ... ]  (client mode, report latency)\n", name);
+   fprintf(stderr,"   or: %s -c -s ms [ shell-command ... ] (client mode, synchronised playout)\n", name);
+   fprintf(stderr,"   or: %s -c -j low:high[:max] [ shell-command ... ] (client mode, jitter buffer)\n", name);
+   fprintf(stderr,"   or: %s -c -e prefix:text|fixed:text|regex:re [ shell-command ... ] (client mode, filtered)\n", name);
+   fprintf(stderr,"   or: %s -c -X name [ shell-command ... ] (client mode, a derived pipeline)\n", name);
+   fprintf(stderr,"   or: %s -c -Z zstd|lz4 [ shell-command ... ] (client mode, compressed)\n", name);
+   fprintf(stderr,"   or: %s -O prefix[,size=bytes][,time=secs] shell-command (server mode, recording)\n", name);
+   fprintf(stderr,"   or: %s -u upstream                  (relay mode)\n",    name);
+   fprintf(stderr,"   or: %s -i source                    (server mode, native source)\n", name);
+   fprintf(stderr,"   or: %s -P playlist [ -C ]           (server mode, a sequence of sources)\n", name);
+   fprintf(stderr,"   or: %s -r                           (restart source)\n", name);
+   fprintf(stderr,"options: -n basename, -u upstream, -l [host:]port, -m group:port[,rtp...], -z, -b bytes, -H bytes, -k secs, -p, -A ts|mp3, -B command, -W secs, -t sig[:ms],..., -R rate|mp3|ts, -F bytes, -D rr|least|hash[:field], -X name=command, -w\n");
+   die(0,EINVAL);
+}
+
+/* ************************************************************************
+ */
+
+void reopen_server()
+{
+   if ( kill(rd_pidfile(), SIGHUP) != 0 )
+      die("cannot signal server process", EIO);
+}
+
+/* ************************************************************************
+ */
+
+/* move up to <len> bytes from socket <fd> to <out> with splice(), through
+ * a pipe unless <out> is one already; if <out> does not support splice() (a
+ * terminal, say), then fall back to read() and write(); returns the number
+ * of bytes moved, 0 at the end of the connection, or -1; if <out> is
+ * closed, the client is finished
+ */
+
+static pid_t consumer;       // client: the command run by a reconnecting client
+static int   sp_copy;        // client: <out> does not support splice()
+static int   latency;        // client: report latency (-v)
+
+void lat_report(int force);
+void jb_report();
+
+void sink_done()
+{
+   int status = 0;
+
+   if ( latency )
+      lat_report(1);
+   jb_report();
+   if ( consumer && waitpid(consumer, &status, 0) == consumer && ! WIFEXITED(status) )
+      exit(1);
+   exit(WEXITSTATUS(status));
+}
+
+void sig_consumer(int s)
+{
+   int status;
+
+   if ( waitpid(consumer, &status, WNOHANG) == consumer )
+      _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+int xfer(int fd, int out, int len)
+{
+   static int p[2] = { -1, -1 };
+   static int fifo = -1;
+   static char *buf;
+   struct stat sb;
+   int n, nw, off, sz = 1 << 16;
+
+   if ( fifo == -1 )
+   {
+      if ( fstat(out, &sb) == -1 )
+	 die("stat", errno);
+      if ( (fifo = S_ISFIFO(sb.st_mode)) )
+	 fcntl(out, F_SETPIPE_SZ, 1 << 20);
+   }
+
+   if ( len > sz )
+      len = sz;
+
+   if ( ! sp_copy && fifo )
+   {
+      do n = splice(fd, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+      while ( n == -1 && errno == EINTR );
+
+      if ( n >= 0 )
+	 return n;
+      if ( errno == EPIPE )
+	 sink_done();
+      if ( errno != EINVAL )
+	 return -1;
+      sp_copy = 1;
+   }
+
+   if ( ! sp_copy )
+   {
+      if ( p[0] == -1 )
+      {
+	 if ( pipe2(p, O_CLOEXEC) == -1 )
+	    die("pipe2", errno);
+	 fcntl(p[1], F_SETPIPE_SZ, 1 << 20);
+      }
+
+      do n = splice(fd, NULL, p[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+      while ( n == -1 && errno == EINTR );
+
+      if ( n <= 0 )
+	 return n;
+
+      for (off = 0; off < n; off += nw)
+	 if ( (nw = splice(p[0], NULL, out, NULL, n - off, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0 )
+	 {
+	    nw = 0;
+	    if ( errno == EINTR )
+	       continue;
+	    if ( errno == EPIPE )
+	       sink_done();
+	    if ( errno != EINVAL )
+	       die("splice", errno);
+	    sp_copy = 1;
+	    break;
+	 }
+
+      if ( off )
+	 return off;   // anything left in the pipe is drained below, next time
+   }
 
-      fprintf(stderr, "bufsz: %d\n", bufsz);
+   /* read() and write(), draining whatever is in the pipe first
+    */
 
-      if ( bufsz <= 0 )
-	 die("bufsz", EINVAL);
+   if ( ! buf && ! ( buf = malloc(sz) ) )
+      die("malloc", errno);
 
-      if ( ! ( buffer = malloc(bufsz) ) )
-	 die("malloc", errno);
+   do
+      if ( p[0] != -1 && ioctl(p[0], FIONREAD, &n) == 0 && n > 0 )
+	 n = read(p[0], buf, len);
+      else
+	 n = read(fd, buf, len);
+   while ( n == -1 && errno == EINTR );
+
+   if ( n <= 0 )
+      return n;
+
+   for (off = 0; off < n; off += nw)
+      if ( (nw = write(out, buf + off, n - off)) < 0 )
+      {
+	 nw = 0;
+	 if ( errno == EPIPE )
+	    sink_done();
+	 if ( errno != EINTR )
+	    die("write", errno);
+      }
+
+   return n;
+}
+
+/* a raw stream; returns when the connection ends (0) or fails (-1), having
+ * added the number of bytes moved to *<count>
+ */
+
+int pump(int fd, int out, long long *count)
+{
+   int n;
+
+   while ( (n = xfer(fd, out, 1 << 16)) > 0 )
+      *count += n;
+   return n;
+}
+
+/* latency statistics (-v)
+ */
+
+static long long lat_n, lat_min, lat_max, lat_sum, lat_next;
+
+void lat_report(int force)
+{
+   long long now = now_ms();
+
+   if ( ! force && now < lat_next )
+      return;
+
+   lat_next = now + REPORTINT * 1000;
+   if ( lat_n )
+      fprintf(stderr, "latency: n=%lld min=%.1fms avg=%.1fms max=%.1fms\n",
+	 lat_n, lat_min / 1e6, lat_sum / lat_n / 1e6, lat_max / 1e6);
+   lat_n = lat_sum = lat_max = 0;
+}
+
+void sig_stats(int s)
+{
+   if ( latency )
+      lat_report(1);
+   jb_report();
+   _exit(0);
+}
+
+void lat_add(long long ns)
+{
+   if ( ! lat_n || ns < lat_min )
+      lat_min = ns;
+   if ( ns > lat_max )
+      lat_max = ns;
+   lat_sum += ns;
+   lat_n   += 1;
+   lat_report(0);
+}
+
+/* read exactly <n> bytes; returns 1, 0 at the end of the connection (before
+ * any data), or -1
+ */
+
+int read_all(int fd, void *buf, int n)
+{
+   int off, nr;
+
+   for (off = 0; off < n; off += nr)
+      if ( (nr = read(fd, (char *) buf + off, n - off)) <= 0 )
+      {
+	 if ( nr == -1 && errno == EINTR )
+	 {
+	    nr = 0;
+	    continue;
+	 }
+	 return off || nr == -1 ? -1 : 0;
+      }
+
+   return 1;
+}
+
+/* read the next data frame's header into <h>, skipping frames of other
+ * types, and checking its sequence number against the stream offset
+ * *<count>; returns the length of its payload (which is to be read next), 0
+ * at the end of the connection, or -1
+ */
+
+int read_frame(int fd, unsigned char *h, long long *count)
+{
+   static char skip[1 << 12];
+   long long seq;
+   int n, len;
+
+   for (;;)
+   {
+      if ( (n = read_all(fd, h, FRAMEHDR)) != 1 )
+	 return n;
+
+      len = (int) get_be(h, 4);
+      if ( get_be(h + 4, 4) == 'D' )
+	 break;
+
+      for (; len; len -= n)
+      {
+	 n = len < (int) sizeof(skip) ? len : (int) sizeof(skip);
+	 if ( read_all(fd, skip, n) != 1 )
+	    return -1;
+      }
+   }
+
+   if ( (seq = (long long) get_be(h + 8, 8)) != *count )
+   {
+      fprintf(stderr, "gap of %lld bytes at offset %lld\n", seq - *count, *count);
+      *count = seq;
+   }
+
+   return len;
+}
+
+/* a framed stream; as pump(), but *<count> is the stream offset, checked
+ * against the sequence numbers in the headers
+ */
+
+int pump_framed(int fd, int out, long long *count)
+{
+   unsigned char h[FRAMEHDR];
+   int n, len;
+
+   while ( (len = read_frame(fd, h, count)) > 0 )
+   {
+      for (; len; len -= n, *count += n)
+	 if ( (n = xfer(fd, out, len)) <= 0 )
+	    return -1;
+
+      if ( latency )
+	 lat_add(now_ns() - (long long) get_be(h + 16, 8));
    }
 
-   do err = fread(buffer, bufsz, 1, src);
-   while ( err < 1 && ( errno == EINTR || errno == EAGAIN ) );
+   return len;
+}
+
+/* a compressed stream (-Z): frames, one after the other, decompressed as
+ * they are read; returns as pump() does
+ */
 
-   if ( err != 1 )
-      die("fread", errno);
+void put_out(int out, char *p, int len)
+{
+   int nw;
 
-   return err == 1;
+   for (; len; p += nw, len -= nw)
+      if ( (nw = write(out, p, len)) < 0 )
+      {
+	 nw = 0;
+	 if ( errno == EPIPE )
+	    sink_done();
+	 if ( errno != EINTR )
+	    die("write", errno);
+      }
 }
 
-/* ************************************************************************
+int unpack(int fd, int out, long long *count)
+{
+#ifdef WITH_COMPRESS
+   static char in[1 << 16], buf[1 << 18];
+   int n = 0, pos, full;
+#ifdef WITH_ZSTD
+   ZSTD_DStream *ds = 0;
+
+   if ( codec == COMP_ZSTD && ( ! (ds = ZSTD_createDStream()) || ZSTD_isError(ZSTD_initDStream(ds)) ) )
+      die("zstd", ENOMEM);
+#endif
+#ifdef WITH_LZ4
+   LZ4F_dctx *dctx = 0;
+
+   if ( codec == COMP_LZ4 && LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)) )
+      die("lz4", ENOMEM);
+#endif
+
+   /* (until the input is used, and the decoder has nothing more: a frame
+    * can decode to more than fits in <buf>)
+    */
+
+   while ( (n = read(fd, in, sizeof(in))) > 0 || ( n == -1 && errno == EINTR ) )
+      for (pos = full = 0; pos < n || full; )
+      {
+	 size_t done = 0;
+#ifdef WITH_ZSTD
+	 if ( codec == COMP_ZSTD )
+	 {
+	    ZSTD_inBuffer  ib = { in + pos, n - pos, 0 };
+	    ZSTD_outBuffer ob = { buf, sizeof(buf), 0 };
+
+	    if ( ZSTD_isError(ZSTD_decompressStream(ds, &ob, &ib)) )
+	       return errno = EPROTO, -1;
+	    pos += ib.pos;
+	    done = ob.pos;
+	 }
+#endif
+#ifdef WITH_LZ4
+	 if ( codec == COMP_LZ4 )
+	 {
+	    size_t src = n - pos;
+
+	    done = sizeof(buf);
+	    if ( LZ4F_isError(LZ4F_decompress(dctx, buf, &done, in + pos, &src, NULL)) )
+	       return errno = EPROTO, -1;
+	    pos += src;
+	 }
+#endif
+	 put_out(out, buf, done);
+	 *count += done;
+	 full = done == sizeof(buf);
+      }
+
+   return n;
+#else
+   return errno = EPROTO, -1;
+#endif
+}
+
+/* the playout buffer (-s): frames read from the server, in order, waiting
+ * to be written to the consumer; with synchronised playout, each is written
+ * at its capture time plus a fixed latency, so that clients on different
+ * machines (with synchronised clocks) play together
  */
 
-void write_buf()
+struct frame
 {
-   int i = 0;
+   struct frame *next;
+   long long     ts;         // capture time (ns)
+   int           len;
+   int           done;       // bytes written so far
+   char          data[];
+};
+
+static struct frame *pb_head, *pb_tail;
+static long long pb_bytes;   // bytes in the playout buffer
+static int   sync_ms = -1;   // client: synchronised playout latency (-s)
+
+/* the jitter buffer (-j LOW:HIGH[:MAX]): the playout buffer fills to HIGH
+ * bytes before anything is written to the consumer; if it runs dry while the
+ * consumer is waiting (an underrun), writing stops until it has refilled to
+ * LOW; the client reads no more than MAX bytes ahead
+ */
 
-   while ( i < cnt )
+static int   jb_low, jb_high, jb_max;
+static int   jb_wait = 1;    // filling, not playing
+static long long jb_underruns, jb_stalled, jb_since;
+
+int buffered()
+{
+   return sync_ms >= 0 || jb_high;
+}
+
+/* has the consumer run dry?  only a pipe can say; otherwise, it is always
+ * waiting
+ */
+
+int starved(int out)
+{
+   int n;
+
+   return ioctl(out, FIONREAD, &n) == -1 || n == 0;
+}
+
+void jb_report()
+{
+   if ( jb_high )
+      fprintf(stderr, "jitter: %lld underruns, stalled %lldms\n", jb_underruns, jb_stalled);
+}
+
+/* read a frame's payload into the playout buffer
+ */
+
+int frame_in(int fd, unsigned char *h, int len)
+{
+   struct frame *f;
+
+   if ( ! ( f = malloc(sizeof(*f) + len) ) )
+      die("malloc", errno);
+
+   if ( read_all(fd, f->data, len) != 1 )
+   {
+      free(f);
+      return -1;
+   }
+
+   f->next = 0;
+   f->ts   = (long long) get_be(h + 16, 8);
+   f->len  = len;
+   f->done = 0;
+
+   if ( pb_tail )
+      pb_tail->next = f;
+   else
+      pb_head = f;
+   pb_tail   = f;
+   pb_bytes += len;
+   return 0;
+}
+
+/* write (some of) the first frame to the (non-blocking) consumer
+ */
+
+void frame_out(int out)
+{
+   struct frame *f = pb_head;
+   int nw;
+
+   if ( (nw = write(out, f->data + f->done, f->len - f->done)) < 0 )
+   {
+      if ( errno == EPIPE )
+	 sink_done();
+      if ( errno != EAGAIN && errno != EINTR )
+	 die("write", errno);
+      return;
+   }
+
+   pb_bytes -= nw;
+   if ( (f->done += nw) < f->len )
+      return;
+
+   if ( latency )
+      lat_add(now_ns() - f->ts);
+
+   if ( ! ( pb_head = f->next ) )
+      pb_tail = 0;
+   free(f);
+}
+
+/* as pump_framed(), but through the playout buffer
+ */
+
+int playout(int fd, int out, long long *count)
+{
+   unsigned char h[FRAMEHDR];
+   struct pollfd pfd[2];
+   struct timespec tmo, *tp;
+   long long wait;
+   int len;
+
+   mk_nonblocking(out);
+   if ( ! jb_max )
+      jb_max = jb_high ? 2 * jb_high : PLAYOUTMAX;
+   if ( ! jb_high )
+      jb_wait = 0;
+
+   for (;;)
    {
-      int off, nw, nr = bufsz;
+      pfd[0] = (struct pollfd) { pb_bytes < jb_max ? fd : -1, POLLIN, 0 };
+      pfd[1] = (struct pollfd) { -1, POLLOUT, 0 };
+      tp     = NULL;
 
-      for (off = 0; nr != 0; nr -= nw, off += nw)
-	 if ( ( nw = write(fd[i], buffer + off, nr) ) < 0 )
+      if ( jb_wait && pb_bytes >= ( jb_since ? jb_low : jb_high ) )
+      {
+	 if ( jb_since )
 	 {
-	    nw = 0;
-	    if ( errno != EINTR )
-	       break;
+	    jb_stalled += now_ms() - jb_since;
+	    fprintf(stderr, "jitter: resumed after %lldms\n", now_ms() - jb_since);
+	 }
+	 jb_wait = 0;
+      }
+
+      if ( ! pb_head && ! jb_wait && jb_high )
+      {
+	 if ( starved(out) )
+	 {
+	    jb_wait  = 1;
+	    jb_since = now_ms();
+	    jb_underruns += 1;
+	    fprintf(stderr, "jitter: underrun at offset %lld\n", *count);
 	 }
+	 else
+	 {
+	    tmo = (struct timespec) { 0, 10000000 }; // look again in 10ms
+	    tp  = &tmo;
+	 }
+      }
 
-      if ( nr == 0 )
+      if ( pb_head && ! jb_wait )
       {
-	 // successful write: move on to next client
-	 i += 1;
-	 continue;
+	 wait = sync_ms < 0 ? 0 : pb_head->ts + sync_ms * 1000000LL - now_ns();
+	 if ( wait <= 0 )
+	    pfd[1].fd = out;
+	 else
+	 {
+	    tmo.tv_sec  = wait / 1000000000;
+	    tmo.tv_nsec = wait % 1000000000;
+	    tp = &tmo;
+	 }
       }
 
-      // unsuccessful write: close this client
-      fprintf(stderr, "drop: %d/%d --> %d\n", i, cnt, cnt-1);
-      close(fd[i]);
+      if ( ppoll(pfd, 2, tp, NULL) == -1 )
+      {
+	 if ( errno == EINTR )
+	    continue;
+	 die("ppoll", errno);
+      }
 
-      int j;
-      for ( j=i+1; j<cnt; j+=1 )
-	 fd[j-1] = fd[j];
+      if ( pfd[1].revents )
+	 frame_out(out);
 
-      fd[--cnt] = 0;
+      if ( pfd[0].revents )
+      {
+	 if ( (len = read_frame(fd, h, count)) <= 0 )
+	    return len;
+	 if ( frame_in(fd, h, len) == -1 )
+	    return -1;
+	 *count += len;
+      }
    }
 }
 
-/* ************************************************************************
+/* run the command as the consumer, with a pipe as its standard input;
+ * returns the pipe
  */
 
-void usage(char *name)
+int spawn(char *argv[])
 {
-   fprintf(stderr,"usage: %s shell-command [ arg ... ]    (server mode)\n",    name);
-   fprintf(stderr,"   or: %s -c shell-command [ arg ... ] (client mode)\n",    name);
-   fprintf(stderr,"   or: %s -r                           (restart source)\n", name);
-   die(0,EINVAL);
+   int p[2];
+
+   if ( pipe2(p, O_CLOEXEC) == -1 )
+      die("pipe2", errno);
+
+   signal(SIGCHLD, sig_consumer);
+   if ( (consumer = fork()) == -1 )
+      die("fork", errno);
+
+   if ( consumer == 0 )
+   {
+      if ( dup2(p[0], STDIN_FILENO) == -1 )
+	 die("dup2", EIO);
+      signal(SIGPIPE, SIG_DFL);
+      execvp(argv[0], argv);
+      die("execvp", errno);
+   }
+
+   close(p[0]);
+   return p[1];
 }
 
-/* ************************************************************************
+/* the built-in sink, or a consumer (-v)
  */
 
-void reopen_server()
+void stats_start()
 {
-   if ( kill(rd_pidfile(), SIGHUP) != 0 )
-      die("cannot signal server process", EIO);
+   lat_next = now_ms() + REPORTINT * 1000;
+   signal(SIGINT,  sig_stats);
+   signal(SIGTERM, sig_stats);
 }
 
-/* ************************************************************************
- */
+void sink(int fd, int out, int framed, long long off)
+{
+   int n;
 
-static int   default_client_argc   = 1;
-static char *default_client_argv[] = { "cat", NULL };
+   if ( latency || jb_high )
+      stats_start();
 
-void client(int argc, char *argv[], int opt_dryrun)
+   if ( unpacking )
+      n = unpack(fd, out, &off);
+   else if ( ! framed )
+      n = pump(fd, out, &off);
+   else
+      n = buffered() ? playout(fd, out, &off) : pump_framed(fd, out, &off);
+
+   if ( n == -1 )
+      die("splice", errno);
+   close(out); // (the consumer's end of the stream)
+   sink_done();
+}
+
+/* a reconnecting client: run the command (if any) with a pipe as its
+ * standard input, and feed the stream into that pipe (or to the output),
+ * across as many connections as it takes
+ */
+
+void reconnecting(int argc, char *argv[], int out)
 {
-   struct sockaddr_un addr = mk_sockaddr();
-   int fd;
+   unsigned long long e = 0;
+   long long off = 0;
+   int fd, backoff = 100;
 
-   if ( argc == 0 )
+   if ( argc )
+      out = spawn(argv);
+
+   if ( latency || jb_high )
+      stats_start();
+
+   for (;;)
    {
-      argc = default_client_argc;
-      argv = default_client_argv;
+      if ( (fd = connect_to(upstream)) == -1 || say_hello(fd, "framed,resume", &e, &off) != 1 )
+      {
+	 fprintf(stderr, "connect: %s (retry in %dms)\n", fd == -1 ? strerror(errno) : "no hello", backoff);
+	 if ( fd != -1 )
+	    close(fd);
+	 usleep(backoff * 1000);
+	 if ( (backoff *= 2) > MAXBACKOFF )
+	    backoff = MAXBACKOFF;
+	 continue;
+      }
+
+      backoff = 100;
+      if ( buffered() )
+	 playout(fd, out, &off);
+      else
+	 pump_framed(fd, out, &off);
+      close(fd);
+      fprintf(stderr, "connection lost at offset %lld, reconnecting\n", off);
    }
+}
+
+static char *output;         // client: output file for the built-in sink (-o)
+static int   reconnect;      // client: reconnect and resume (-a)
+
+void client(int argc, char *argv[], int opt_dryrun)
+{
+   unsigned long long e = 0;
+   long long off = 0;
+   int fd, framed, out = STDOUT_FILENO;
+
+   if ( argc && output )
+      die("-o is for the built-in sink (no command)", EINVAL);
 
-   if ( (fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0 )
-      die("socket", errno);
+   if ( filter && ( reconnect || latency || buffered() ) )
+      die("-e: a filtered stream is raw (not for -a, -v, -s or -j)", EINVAL);
 
-   if( connect(fd, (struct sockaddr *) &addr, SUN_LEN(&addr)) )
+   if ( output && (out = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1 )
+      die(output, errno);
+
+   signal(SIGPIPE, SIG_IGN);
+   if ( reconnect )
+      reconnecting(argc, argv, out); // never returns
+
+   if ( (fd = connect_to(upstream)) == -1 )
       die("connect", errno);
 
+   /* say hello, so as not to wait HELLOWAIT ms for the stream
+    */
+   if ( (framed = say_hello(fd, latency || buffered() ? "framed" : "raw", &e, &off)) == -1 )
+      die("hello", EPROTO);
+
+   if ( buffered() && ! framed )
+      die("the playout buffer needs a framed stream", EPROTO);
+
+   if ( argc && ( latency || framed || unpacking ) )
+      out = spawn(argv);
+
+   if ( argc == 0 || latency || framed || unpacking )
+      sink(fd, out, framed, off);
+
+   signal(SIGPIPE, SIG_DFL);
+
    close(STDIN_FILENO);
    if ( dup2(fd, STDIN_FILENO) == -1 )
       die("dup2", EIO);
@@ -546,7 +5330,7 @@ int main(int argc, char *argv[])
    {
       int opt;
 
-      while ( (opt = getopt(argc, argv, "dwcrt:n:")) != -1 )
+      while ( (opt = getopt(argc, argv, "+dwzcravpCt:n:u:l:m:b:o:s:j:i:k:A:B:W:P:R:F:D:e:X:Z:O:H:")) != -1 )
       {
 	 switch ( opt )
 	 {
@@ -563,11 +5347,130 @@ int main(int argc, char *argv[])
 	       opt_restart = 1;
 	       break;
 	    case 't':
-	       src_kill = atoi(optarg);
+	       kill_strategy(optarg);
 	       break;
 	    case 'n':
                tmpbasename = optarg;
 	       break;
+	    case 'u':
+	       upstream = optarg;
+	       break;
+	    case 'l':
+	       listen_on = optarg;
+	       break;
+	    case 'm':
+	       mcast = optarg;
+	       break;
+	    case 'i':
+	       input = optarg;
+	       break;
+	    case 'k':
+	       linger = atoi(optarg);
+	       break;
+	    case 'p':
+	       prestart = 1;
+	       break;
+	    case 'B':
+	       backup = optarg;
+	       break;
+	    case 'P':
+	       playlist = optarg;
+	       break;
+	    case 'D':
+	       if ( ! strcmp(optarg, "rr") )
+		  dist = DIST_RR;
+	       else if ( ! strcmp(optarg, "least") )
+		  dist = DIST_LEAST;
+	       else if ( ! strncmp(optarg, "hash", 4) && ( ! optarg[4] || optarg[4] == ':' ) )
+	       {
+		  dist = DIST_HASH;
+		  dist_field = optarg[4] ? atoi(optarg + 5) : 0;
+	       }
+	       else
+		  die("-D rr|least|hash[:field]", EINVAL);
+	       break;
+	    case 'F':
+	       if ( (window = atoi(optarg)) <= 0 )
+		  die("-F bytes", EINVAL);
+	       break;
+	    case 'R':
+	       if ( ! strcmp(optarg, "mp3") )
+		  pace = PACE_MP3;
+	       else if ( ! strcmp(optarg, "ts") )
+		  pace = PACE_TS;
+	       else
+	       {
+		  pace     = PACE_RATE;
+		  pace_bps = strtoll(optarg, &cp, 10);
+		  pace_bps *= *cp == 'k' ? 1000 : *cp == 'M' ? 1000000 : 1;
+		  if ( pace_bps <= 0 )
+		     die("-R bits/s[k|M]|mp3|ts", EINVAL);
+	       }
+	       break;
+	    case 'C':
+	       pl_loop = 1;
+	       break;
+	    case 'W':
+	       if ( (watchdog = atoi(optarg)) <= 0 )
+		  die("-W secs", EINVAL);
+	       break;
+	    case 'A':
+	       if ( ! strcmp(optarg, "ts") )
+		  align = ALIGN_TS;
+	       else if ( ! strcmp(optarg, "mp3") )
+		  align = ALIGN_MP3;
+	       else
+		  die("-A ts|mp3", EINVAL);
+	       break;
+	    case 'z':
+	       zerocopy = 1;
+	       break;
+	    case 'b':
+	       bufsz = atoi(optarg);
+	       break;
+	    case 'o':
+	       output = optarg;
+	       break;
+	    case 'e':
+	       filter = optarg;
+	       break;
+	    case 'Z':
+	       if ( ! (codec = comp_codec(optarg)) )
+		  die("-Z zstd|lz4 (as built, see the Makefile)", EINVAL);
+	       break;
+	    case 'X':
+	       if ( ! (cp = strchr(optarg, '=')) )
+		  derived = optarg;
+	       else if ( cp == optarg || memchr(optarg, '/', cp - optarg) || nderived == MAXDERIVED )
+		  die("-X name=command", EINVAL);
+	       else
+	       {
+		  *cp = 0;
+		  dv_name[nderived]  = optarg;
+		  dv_cmd[nderived++] = cp + 1;
+	       }
+	       break;
+	    case 'a':
+	       reconnect = 1;
+	       break;
+	    case 'v':
+	       latency = 1;
+	       break;
+	    case 's':
+	       sync_ms = atoi(optarg);
+	       break;
+	    case 'j':
+	       if ( sscanf(optarg, "%d:%d:%d", &jb_low, &jb_high, &jb_max) < 2 || jb_low > jb_high || jb_high <= 0 )
+		  die("-j LOW:HIGH[:MAX]", EINVAL);
+	       if ( jb_max && jb_max < jb_high )
+		  die("-j: MAX is less than HIGH", EINVAL);
+	       break;
+	    case 'H':
+	       history = atoi(optarg);
+	       break;
+	    case 'O':
+	       record = optarg;
+	       break;
 	    default:
 	       usage(my_name);
 	       die("unreachable", 0);
@@ -597,10 +5500,17 @@ int main(int argc, char *argv[])
       tmpbasename = print(0, "%s", cs);
    }
 
+   if ( derived ) // (see derived_start())
+      tmpbasename = print(0, "%s.%s", tmpbasename, derived);
+
    PIDFILE  = print(0, "%s/delivery.%s.pid",  TMPDIR, tmpbasename);
    SOCKFILE = print(0, "%s/delivery.%s.sock", TMPDIR, tmpbasename);
    LOCKFILE = print(0, "%s/delivery.%s.lock", TMPDIR, tmpbasename);
-   printf("%s\n", SOCKFILE);
+
+   /* not for clients: their standard output is the stream
+    */
+   if ( ! opt_client || opt_dryrun )
+      printf("%s\n", SOCKFILE);
 
    if ( opt_dryrun )
       exit(0);
@@ -615,16 +5525,31 @@ int main(int argc, char *argv[])
    /* if we reach here, then this is the server process ...
     */
 
-   if ( ! argc )
+   if ( ! argc && ! upstream && ! input && ! playlist )
       die("no arguments", 1);
 
+   if ( playlist && ( argc || upstream || input ) )
+      die("a playlist (-P) takes no command", 1);
+
+   if ( argc && upstream )
+      die("relay mode (-u) takes no command", 1);
+
+   if ( dist && ( window || history ) )
+      die("distribution (-D) is not for flow control (-F) or history (-H)", 1);
+
+   if ( input && ( argc || upstream ) )
+      die("a native source (-i) takes no command", 1);
+
+   if ( backup && ( input || upstream || playlist ) )
+      die("a standby (-B) is for command sources", 1);
+
    /* lock file: we want at most one server process ...
     */
 
    {
       LOCKFILE = print(0, "%s/delivery.%s.lock", TMPDIR, tmpbasename);
 
-      int fd = open(LOCKFILE, O_CREAT | O_RDWR, S_IRWXU | S_IRWXG | S_IRWXO );
+      int fd = open(LOCKFILE, O_CREAT | O_RDWR | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO );
       if ( fd == -1 )
       {
          fprintf(stderr, "error: could not create lock file: %s\n", LOCKFILE);
@@ -649,26 +5574,79 @@ int main(int argc, char *argv[])
    /* signals and pidfile
     */
 
-   signal(SIGHUP,  reopen_src);
-   signal(SIGTERM, sig_die);
-   signal(SIGINT,  sig_die);
-   signal(SIGKILL, sig_die);
-   signal(SIGCHLD, sig_die);
+   {
+      sigset_t set;
+
+      sigemptyset(&set);
+      sigaddset(&set, SIGHUP);
+      sigaddset(&set, SIGTERM);
+      sigaddset(&set, SIGINT);
+      sigaddset(&set, SIGCHLD);
+      sigaddset(&set, SIGUSR1);
+      sigaddset(&set, SIGALRM);
+      sigprocmask(SIG_BLOCK, &set, NULL);
+      if ( (sig_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) == -1 )
+	 die("signalfd", errno);
+   }
    signal(SIGPIPE, SIG_IGN);
 
+   prctl(PR_SET_CHILD_SUBREAPER, 1); // a source's orphans are reaped here, so its group goes
+   if ( timer_create(CLOCK_MONOTONIC, &(struct sigevent) { .sigev_notify = SIGEV_SIGNAL, .sigev_signo = SIGALRM }, &kill_timer) )
+      die("timer_create", errno);
+
+   if ( watchdog )
+   {
+      long long tick = watchdog * 250000LL; // us
+      struct itimerval it = { { tick / 1000000, tick % 1000000 }, { tick / 1000000, tick % 1000000 } };
+
+      setitimer(ITIMER_REAL, &it, NULL);
+      stall_ms = watchdog * 1000;
+   }
+
    wrt_pidfile();
 
+   for (i = 0; i < nderived; i += 1)
+      derived_start(i);
+
+   epoch = ( (unsigned long long) time(NULL) << 20 ) ^ (unsigned long long) getpid();
+
+   if ( mcast )
+      open_mcast();
+
+   if ( record )
+      open_rec();
+
    /* main server loop ...
     */
 
    do
    {
       check_for_new_clients(); // blocking, but only if there are no active clients
+      check_hellos();
+      if ( ! demand() )
+	 continue; // (the only new client failed its hello: no source, and back to waiting)
       open_src(argv);
-      if ( read_buf() )
-         write_buf(); 
+      if ( src == -1 )
+	 continue; // (a relay whose upstream is gone, and whose clients have gone too)
+      open_standby();
+      if ( window && ring )
+	 flow(window > bufsz ? window - bufsz : 0);
+      if ( fast_path() )
+	 splice_buf();
+      else if ( read_buf() )
+      {
+	 if ( dist )
+	    write_dist();
+	 else
+	    write_buf();
+	 if ( nfilter )
+	    write_filtered();
+	 write_comp();
+	 write_rec();
+	 write_mcast();
+      }
    }
-   while ( cnt );
+   while ( demand() || derived || nderived || ! served ); // (a derived server stays, see derived_start(); so does one with derived servers, for them, and one yet to have a client)
 
    die("",0);
    return 0;